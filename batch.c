@@ -0,0 +1,542 @@
+/**
+ * @file batch.c
+ * Batch mode crypting many files in place with a pool of threads.
+ */
+#define _GNU_SOURCE
+#include "batch.h"
+
+#include "pool.h"
+#include "stats.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** File to crypt in batch mode */
+struct batch_file {
+    char *path;
+    uint64_t size;
+};
+
+/** Growable list of the files to crypt */
+struct batch_files {
+    struct batch_file *files;
+    size_t n;
+    size_t cap;
+};
+
+/**
+ * Task of batch mode. A task holding one file crypts the bytes from off to
+ * off + len of it, while a task holding several crypts all of each.
+ */
+struct batch_task {
+    size_t file;   /**< Index of the first file */
+    size_t nfiles; /**< Number of files */
+    uint64_t off;
+    size_t len;
+};
+
+/** Deque of tasks owned by one worker, a range of the shared task array */
+struct batch_deque {
+    pthread_mutex_t lock;
+    size_t head; /**< Next task taken by the owner */
+    size_t tail; /**< One past the last task, where thieves steal from */
+};
+
+/** Shared state of a batch run */
+struct batch {
+    const struct caesar_key *key;
+    const struct batch_file *files;
+    const struct batch_task *tasks;
+    struct batch_deque *deques;
+    size_t nthreads;
+    struct pool *pool; /**< One buffer per worker, on its own list */
+    pthread_mutex_t err_lock;
+    int err;           /**< First errno seen by any worker, or 0 */
+    char *failed_path; /**< Copy of the path that failed, if any */
+};
+
+/** Arguments of one batch worker thread */
+struct batch_worker_args {
+    struct batch *batch;
+    size_t id; /**< Index of the worker's own deque */
+};
+
+/**
+ * @brief Add a file to the list
+ * @param list  List to add to
+ * @param path  Path of the file, taken over by the list on success
+ * @param size  Size of the file in bytes
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int files_add(struct batch_files *list, char *path, uint64_t size)
+{
+    if (list->n == list->cap) {
+        size_t cap = list->cap > 0 ? 2 * list->cap : 64;
+        struct batch_file *files =
+            reallocarray(list->files, cap, sizeof(*files));
+        if (files == NULL) {
+            return -1;
+        }
+        list->files = files;
+        list->cap = cap;
+    }
+    list->files[list->n++] = (struct batch_file){path, size};
+    return 0;
+}
+
+/**
+ * @brief Add every regular file below a directory to the list
+ * @param list          List to add to
+ * @param dir_path      Path of the directory
+ * @param failed_path   Set to a copy of the failing path on failure
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int files_add_dir(struct batch_files *list, const char *dir_path,
+                         char **failed_path)
+{
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        *failed_path = strdup(dir_path);
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent *entry;
+    errno = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char *path;
+        if (asprintf(&path, "%s/%s", dir_path, entry->d_name) < 0) {
+            ret = -1;
+            break;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            *failed_path = path;
+            ret = -1;
+            break;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            ret = files_add_dir(list, path, failed_path);
+            free(path);
+        } else if (S_ISREG(st.st_mode)) {
+            ret = files_add(list, path, st.st_size);
+            if (ret < 0) {
+                free(path);
+            }
+        } else {
+            free(path);
+        }
+        if (ret < 0) {
+            break;
+        }
+        errno = 0;
+    }
+    if (ret == 0 && errno != 0) {
+        *failed_path = strdup(dir_path);
+        ret = -1;
+    }
+
+    int saved_errno = errno;
+    closedir(dir);
+    errno = saved_errno;
+    return ret;
+}
+
+/**
+ * @brief Add every file named in a list file to the list
+ * @param list          List to add to
+ * @param list_path     Path of the list file, or "-" for stdin
+ * @param failed_path   Set to a copy of the failing path on failure
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int files_add_list(struct batch_files *list, const char *list_path,
+                          char **failed_path)
+{
+    FILE *in = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+    if (in == NULL) {
+        *failed_path = strdup(list_path);
+        return -1;
+    }
+
+    int ret = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    errno = 0;
+    while ((len = getline(&line, &cap, in)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+
+        struct stat st;
+        if (stat(line, &st) == 0 && !S_ISREG(st.st_mode)) {
+            errno = EINVAL;
+        }
+        if (errno != 0) {
+            *failed_path = strdup(line);
+            ret = -1;
+            break;
+        }
+        char *path = strdup(line);
+        if (path == NULL || files_add(list, path, st.st_size) < 0) {
+            free(path);
+            ret = -1;
+            break;
+        }
+        errno = 0;
+    }
+    if (ret == 0 && ferror(in)) {
+        *failed_path = strdup(list_path);
+        ret = -1;
+    }
+
+    int saved_errno = errno;
+    free(line);
+    if (in != stdin) {
+        fclose(in);
+    }
+    errno = saved_errno;
+    return ret;
+}
+
+/**
+ * @brief Cut the files into tasks of at most BATCH_CHUNK bytes
+ * @param files     Files to crypt
+ * @param nfiles    Number of files
+ * @param ntasks    Set to the number of tasks
+ * @return Newly allocated array of tasks, or NULL on failure with errno set
+ */
+static struct batch_task *batch_plan(const struct batch_file *files,
+                                     size_t nfiles, size_t *ntasks)
+{
+    // Every file needs at most one task, plus one per BATCH_CHUNK of data
+    size_t cap = nfiles;
+    for (size_t i = 0; i < nfiles; i++) {
+        cap += files[i].size / BATCH_CHUNK;
+    }
+    struct batch_task *tasks = calloc(cap > 0 ? cap : 1, sizeof(*tasks));
+    if (tasks == NULL) {
+        return NULL;
+    }
+
+    size_t n = 0;
+    struct batch_task *pack = NULL;
+    for (size_t i = 0; i < nfiles; i++) {
+        uint64_t size = files[i].size;
+        if (size == 0) {
+            continue;
+        }
+        if (size >= BATCH_CHUNK) {
+            for (uint64_t off = 0; off < size; off += BATCH_CHUNK) {
+                uint64_t left = size - off;
+                tasks[n++] = (struct batch_task){
+                    i, 1, off, left < BATCH_CHUNK ? left : BATCH_CHUNK};
+            }
+            pack = NULL;
+            continue;
+        }
+
+        // Files only join a pack that directly precedes them
+        if (pack == NULL || pack->file + pack->nfiles != i ||
+            pack->len + size > BATCH_CHUNK || pack->nfiles == BATCH_PACK_MAX) {
+            pack = &tasks[n++];
+            *pack = (struct batch_task){i, 0, 0, 0};
+        }
+        pack->nfiles++;
+        pack->len += size;
+    }
+
+    *ntasks = n;
+    return tasks;
+}
+
+/**
+ * @brief Read from a file at an offset until a buffer is full or EOF
+ * @param fd    File descriptor to read from
+ * @param buf   Buffer to read into
+ * @param len   Number of bytes to read
+ * @param off   Offset in the file to read from
+ * @return Number of bytes read, or -1 on failure with errno set
+ */
+static ssize_t pread_full(int fd, char *buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while (done < len) {
+        uint64_t start = stats_clock();
+        ssize_t n = pread(fd, buf + done, len - done, off + done);
+        if (stats != NULL) {
+            stats_io(&stats->reads, &stats->read_ns, &stats->bytes_read, start,
+                     n);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * @brief Write an entire buffer to a file at an offset
+ * @param fd    File descriptor to write to
+ * @param buf   Buffer to write
+ * @param len   Number of bytes to write
+ * @param off   Offset in the file to write to
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int pwrite_all(int fd, const char *buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while (done < len) {
+        uint64_t start = stats_clock();
+        ssize_t n = pwrite(fd, buf + done, len - done, off + done);
+        if (stats != NULL) {
+            stats_io(&stats->writes, &stats->write_ns, &stats->bytes_written,
+                     start, n);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Crypt part of a file in place
+ * @param key   Prepared key
+ * @param path  Path of the file
+ * @param off   Offset of the part in the file
+ * @param len   Length of the part, at most BATCH_CHUNK bytes
+ * @param buf   Buffer of BATCH_CHUNK bytes
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int crypt_range(const struct caesar_key *key, const char *path,
+                       uint64_t off, size_t len, char *buf)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // A file that shrank since it was listed is crypted as far as it goes
+    ssize_t n = pread_full(fd, buf, len, off);
+    int ret = -1;
+    if (n >= 0) {
+        uint64_t start = stats_clock();
+        caesar_transform_inplace_at(key, off, (uint8_t *)buf, n);
+        if (stats != NULL) {
+            stats_add(&stats->transform_ns, stats_clock() - start);
+        }
+        ret = pwrite_all(fd, buf, n, off);
+    }
+
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return ret;
+}
+
+/**
+ * @brief Take the next task of a worker, stealing one if its deque is empty
+ * @param batch     Batch state
+ * @param id        Index of the worker
+ * @return Index of the task, or SIZE_MAX once no deque has any left
+ */
+static size_t batch_next(struct batch *batch, size_t id)
+{
+    struct batch_deque *own = &batch->deques[id];
+
+    pthread_mutex_lock(&own->lock);
+    size_t task = own->head < own->tail ? own->head++ : SIZE_MAX;
+    pthread_mutex_unlock(&own->lock);
+    if (task != SIZE_MAX) {
+        return task;
+    }
+
+    for (size_t i = 1; i < batch->nthreads; i++) {
+        struct batch_deque *victim = &batch->deques[(id + i) % batch->nthreads];
+
+        // Take the back half, so the victim keeps the tasks it is close to
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->tail - victim->head;
+        size_t tail = victim->tail;
+        victim->tail -= (left + 1) / 2;
+        size_t head = victim->tail;
+        pthread_mutex_unlock(&victim->lock);
+        if (left == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&own->lock);
+        own->head = head + 1;
+        own->tail = tail;
+        pthread_mutex_unlock(&own->lock);
+        return head;
+    }
+    return SIZE_MAX;
+}
+
+/**
+ * @brief Worker thread running tasks until none are left
+ * @param arg   Worker arguments
+ * @return NULL
+ */
+static void *batch_worker(void *arg)
+{
+    struct batch_worker_args *args = arg;
+    struct batch *batch = args->batch;
+
+    // Written first by this worker, so NUMA places it close to it
+    char *buf = pool_get(batch->pool, args->id);
+    if (buf == NULL) {
+        pthread_mutex_lock(&batch->err_lock);
+        if (batch->err == 0) {
+            __atomic_store_n(&batch->err, ENOMEM, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&batch->err_lock);
+        return NULL;
+    }
+
+    size_t id;
+    while (__atomic_load_n(&batch->err, __ATOMIC_RELAXED) == 0 &&
+           (id = batch_next(batch, args->id)) != SIZE_MAX) {
+        const struct batch_task *task = &batch->tasks[id];
+        for (size_t i = task->file; i < task->file + task->nfiles; i++) {
+            const struct batch_file *file = &batch->files[i];
+            uint64_t off = task->nfiles == 1 ? task->off : 0;
+            size_t len = task->nfiles == 1 ? task->len : file->size;
+            if (crypt_range(batch->key, file->path, off, len, buf) < 0) {
+                pthread_mutex_lock(&batch->err_lock);
+                if (batch->err == 0) {
+                    __atomic_store_n(&batch->err, errno, __ATOMIC_RELAXED);
+                    batch->failed_path = strdup(file->path);
+                }
+                pthread_mutex_unlock(&batch->err_lock);
+                break;
+            }
+        }
+    }
+
+    pool_put(batch->pool, buf);
+    return NULL;
+}
+
+int crypt_batch(const struct caesar_key *key, const char *source,
+                size_t nthreads, char **failed_path)
+{
+    *failed_path = NULL;
+
+    struct batch_files list = {0};
+    struct stat st;
+    int ret = -1;
+    if (strcmp(source, "-") != 0 && stat(source, &st) == 0 &&
+        S_ISDIR(st.st_mode)) {
+        ret = files_add_dir(&list, source, failed_path);
+    } else {
+        ret = files_add_list(&list, source, failed_path);
+    }
+
+    size_t ntasks = 0;
+    struct batch_task *tasks = NULL;
+    struct batch_deque *deques = NULL;
+    struct batch_worker_args *args = NULL;
+    pthread_t *threads = NULL;
+    struct pool pool = {0};
+    if (ret < 0) {
+        goto out;
+    }
+    ret = -1;
+
+    tasks = batch_plan(list.files, list.n, &ntasks);
+    if (nthreads > ntasks) {
+        nthreads = ntasks > 0 ? ntasks : 1;
+    }
+    deques = calloc(nthreads, sizeof(*deques));
+    args = calloc(nthreads, sizeof(*args));
+    threads = calloc(nthreads, sizeof(*threads));
+    if (tasks == NULL || deques == NULL || args == NULL || threads == NULL ||
+        pool_init(&pool, BATCH_CHUNK, nthreads, nthreads) < 0) {
+        goto out;
+    }
+
+    struct batch batch = {
+        .key = key,
+        .files = list.files,
+        .tasks = tasks,
+        .deques = deques,
+        .nthreads = nthreads,
+        .pool = &pool,
+        .err_lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    // Consecutive tasks, often of the same file, start on the same worker
+    for (size_t i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].head = ntasks * i / nthreads;
+        deques[i].tail = ntasks * (i + 1) / nthreads;
+        args[i] = (struct batch_worker_args){&batch, i};
+    }
+
+    // Worker 0 runs on this thread, and takes over any that fail to start
+    size_t nstarted = 1;
+    for (; nstarted < nthreads; nstarted++) {
+        if (pthread_create(&threads[nstarted], NULL, batch_worker,
+                           &args[nstarted]) != 0) {
+            break;
+        }
+    }
+    batch_worker(&args[0]);
+    for (size_t i = 1; i < nstarted; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&deques[i].lock);
+    }
+
+    if (batch.err == 0) {
+        ret = 0;
+    } else {
+        *failed_path = batch.failed_path;
+        errno = batch.err;
+    }
+
+out:;
+    int saved_errno = errno;
+    for (size_t i = 0; i < list.n; i++) {
+        free(list.files[i].path);
+    }
+    free(list.files);
+    pool_destroy(&pool);
+    free(tasks);
+    free(deques);
+    free(args);
+    free(threads);
+    errno = saved_errno;
+    return ret;
+}
@@ -0,0 +1,44 @@
+/**
+ * @file batch.h
+ * Batch mode crypting many files in place with a pool of threads.
+ */
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "caesar.h"
+
+#include <stddef.h>
+
+/** Largest number of bytes crypted by one task of crypt_batch() */
+#define BATCH_CHUNK (1024 * 1024)
+
+/** Largest number of small files packed into one task of crypt_batch() */
+#define BATCH_PACK_MAX 256
+
+/**
+ * @brief Crypt every file of a directory tree or list in place
+ *
+ * The files are cut into tasks of at most BATCH_CHUNK bytes: a large file is
+ * split into several tasks, and consecutive small files are packed into one.
+ * Each thread starts with an equal share of the tasks in a deque of its own,
+ * taking them from the front. A thread that runs out steals the back half of
+ * another thread's remaining tasks, so all threads stay busy until the last
+ * task is done.
+ *
+ * Each file is crypted as a stream of its own, so a keyword schedule starts
+ * over at the beginning of every file.
+ *
+ * @param key           Prepared key
+ * @param source        Directory whose regular files are crypted, searched
+ *                      recursively without following symbolic links, or file
+ *                      listing one path per line, with "-" for stdin
+ * @param nthreads      Number of worker threads
+ * @param failed_path   On failure, set to a newly allocated copy of the path
+ *                      that could not be crypted, or NULL if the failure is
+ *                      not due to one file
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int crypt_batch(const struct caesar_key *key, const char *source,
+                size_t nthreads, char **failed_path);
+
+#endif
@@ -0,0 +1,521 @@
+/**
+ * @file bench.c
+ * Benchmark harness for the kernels and stream engines.
+ */
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include "caesar.h"
+#include "stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/** Largest number of bytes crypted by a single call in --bench */
+#define BENCH_CALL_MAX (1024 * 1024)
+
+/** Fewest bytes crypted per kernel, corpus and size in --bench */
+#define BENCH_MIN_BYTES (16 * 1024 * 1024)
+
+/** Fewest calls timed per kernel, corpus and size in --bench */
+#define BENCH_MIN_CALLS 100
+
+/** Largest input the stream engines are benchmarked on */
+#define BENCH_STREAM_MAX (256 * 1024 * 1024)
+
+/** Number of times --bench-startup runs each program */
+#define BENCH_STARTUP_RUNS 1000
+
+/** Key used by --bench */
+#define BENCH_SHIFT 13
+
+/** Synthetic corpora benchmarked by --bench */
+enum bench_corpus {
+    bc_letters, /**< Only ASCII letters */
+    bc_text,    /**< Letters, spaces, digits and punctuation */
+    bc_binary,  /**< Uniformly random bytes, mostly non-ASCII */
+};
+
+/**
+ * @brief Fill a buffer with a reproducible synthetic corpus
+ * @param corpus    Kind of corpus to generate
+ * @param buf       Buffer to fill
+ * @param len       Number of bytes to generate
+ */
+static void bench_fill(enum bench_corpus corpus, uint8_t *buf, size_t len)
+{
+    static const char letters[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+    static const char text[] = "etaoinshrdlucmfwypvbgkjqxz"
+                               "etaoinshrdlucmfwyp ETAOIN     ,.;!?0123\n";
+
+    // xorshift64, seeded identically for every run
+    unsigned long long state = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < len; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        switch (corpus) {
+        case bc_letters:
+            buf[i] = letters[state % (sizeof(letters) - 1)];
+            break;
+        case bc_text:
+            buf[i] = text[state % (sizeof(text) - 1)];
+            break;
+        case bc_binary:
+            buf[i] = state >> 56;
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Read a monotonic clock
+ * @return Current time in nanoseconds
+ */
+static unsigned long long bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Read the CPU's cycle counter where there is one
+ * @return Current cycle count, or 0 if the CPU has no usable counter
+ */
+static unsigned long long bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Compare two latencies, for qsort()
+ * @param a First latency
+ * @param b Second latency
+ * @return Negative, zero or positive as a is less, equal or greater than b
+ */
+static int bench_cmp(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print one result of --bench as a line of JSON
+ * @param kernel    Name of the kernel or engine
+ * @param corpus    Name of the corpus
+ * @param size      Number of input bytes per run
+ * @param bytes     Total number of bytes crypted
+ * @param elapsed   Total time taken in nanoseconds
+ * @param cycles    Total cycles taken, or 0 if unknown
+ * @param lat       Latency of every call in nanoseconds, sorted in place
+ * @param ncalls    Number of calls
+ */
+static void bench_report(const char *kernel, const char *corpus, size_t size,
+                         unsigned long long bytes, unsigned long long elapsed,
+                         unsigned long long cycles, unsigned long long *lat,
+                         size_t ncalls)
+{
+    qsort(lat, ncalls, sizeof(*lat), bench_cmp);
+    printf("{\"kernel\":\"%s\",\"corpus\":\"%s\",\"size\":%zu,"
+           "\"gbps\":%.3f,\"cycles_per_byte\":%.3f,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu}\n",
+           kernel, corpus, size, elapsed > 0 ? (double)bytes / elapsed : 0,
+           (double)cycles / bytes, lat[ncalls / 2], lat[ncalls * 99 / 100]);
+    fflush(stdout);
+}
+
+/**
+ * @brief Benchmark a stream engine reading an in-memory file
+ * @param name      Name to report the engine as
+ * @param key       Prepared key
+ * @param in_fd     Memory file holding the corpus
+ * @param out_fd    File descriptor of /dev/null
+ * @param corpus    Name of the corpus
+ * @param size      Size of the corpus
+ * @param jobs      Number of worker threads, 1 for crypt_stream()
+ * @param lat       Array to hold the latency of every run
+ * @param nruns     Number of runs
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int bench_stream(const char *name, const struct caesar_key *key,
+                        int in_fd, int out_fd, const char *corpus, size_t size,
+                        size_t jobs, unsigned long long *lat, size_t nruns)
+{
+    unsigned long long start = bench_now_ns();
+    unsigned long long start_cycles = bench_cycles();
+    for (size_t i = 0; i < nruns; i++) {
+        unsigned long long call_start = bench_now_ns();
+        if (lseek(in_fd, 0, SEEK_SET) < 0 ||
+            crypt_stream_with(key, in_fd, out_fd, DEFAULT_BLOCK_SIZE, jobs,
+                              false) < 0) {
+            return -1;
+        }
+        lat[i] = bench_now_ns() - call_start;
+    }
+    unsigned long long cycles = bench_cycles() - start_cycles;
+
+    bench_report(name, corpus, size, (unsigned long long)size * nruns,
+                 bench_now_ns() - start, cycles, lat, nruns);
+    return 0;
+}
+
+int bench(size_t max_size)
+{
+    static const char *corpus_names[] = {"letters", "text", "binary"};
+
+    struct caesar_key key;
+    caesar_key_init(&key, BENCH_SHIFT);
+
+    int ret = -1;
+    int in_fd = -1;
+    int out_fd = open("/dev/null", O_WRONLY);
+    uint8_t *buf = malloc(BENCH_CALL_MAX);
+    unsigned long long *lat = NULL;
+    if (out_fd < 0 || buf == NULL) {
+        goto out;
+    }
+
+    for (int corpus = bc_letters; corpus <= bc_binary; corpus++) {
+        for (size_t size = 1024; size <= max_size; size *= 32) {
+            size_t call_size = size < BENCH_CALL_MAX ? size : BENCH_CALL_MAX;
+            size_t total = size < BENCH_MIN_BYTES ? BENCH_MIN_BYTES : size;
+            size_t ncalls = total / call_size;
+            ncalls = ncalls < BENCH_MIN_CALLS ? BENCH_MIN_CALLS : ncalls;
+            size_t nruns = BENCH_MIN_BYTES / size;
+            nruns = nruns < BENCH_MIN_CALLS ? BENCH_MIN_CALLS : nruns;
+
+            free(lat);
+            lat = calloc(ncalls > nruns ? ncalls : nruns, sizeof(*lat));
+            if (lat == NULL) {
+                goto out;
+            }
+
+            for (int kernel = 0; kernel < CAESAR_KERNEL_COUNT; kernel++) {
+                if (caesar_key_set_kernel(&key, kernel) < 0) {
+                    continue;
+                }
+                bench_fill(corpus, buf, call_size);
+
+                unsigned long long start = bench_now_ns();
+                unsigned long long start_cycles = bench_cycles();
+                for (size_t i = 0; i < ncalls; i++) {
+                    unsigned long long call_start = bench_now_ns();
+                    caesar_transform_inplace(&key, buf, call_size);
+                    lat[i] = bench_now_ns() - call_start;
+                }
+                unsigned long long cycles = bench_cycles() - start_cycles;
+
+                bench_report(caesar_kernel_name(kernel), corpus_names[corpus],
+                             size,
+                             (unsigned long long)call_size * ncalls,
+                             bench_now_ns() - start, cycles, lat, ncalls);
+            }
+
+            if (size > BENCH_STREAM_MAX) {
+                continue;
+            }
+            in_fd = memfd_create("caesar-bench", 0);
+            if (in_fd < 0) {
+                goto out;
+            }
+            for (size_t off = 0; off < size; off += call_size) {
+                bench_fill(corpus, buf, call_size);
+                if (write_all(in_fd, (char *)buf, call_size) < 0) {
+                    goto out;
+                }
+            }
+            long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+            if (bench_stream("stream", &key, in_fd, out_fd,
+                             corpus_names[corpus], size, 1, lat, nruns) < 0 ||
+                bench_stream("stream_parallel", &key, in_fd, out_fd,
+                             corpus_names[corpus], size,
+                             ncpus > 1 ? ncpus : 2, lat, nruns) < 0) {
+                goto out;
+            }
+            close(in_fd);
+            in_fd = -1;
+        }
+    }
+    ret = 0;
+
+out:;
+    int saved_errno = errno;
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+    free(buf);
+    free(lat);
+    errno = saved_errno;
+    return ret;
+}
+
+int bench_startup(char *const progs[], size_t nprogs)
+{
+    static char message[] = "Hello, World!";
+
+    int ret = -1;
+    unsigned long long *lat = calloc(BENCH_STARTUP_RUNS, sizeof(*lat));
+    posix_spawn_file_actions_t actions;
+    if (lat == NULL || posix_spawn_file_actions_init(&actions) != 0) {
+        free(lat);
+        return -1;
+    }
+    if (posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                         O_WRONLY, 0) != 0) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < nprogs; i++) {
+        char *argv[] = {progs[i], "-e", "13", message, NULL};
+        unsigned long long start = bench_now_ns();
+        for (size_t run = 0; run < BENCH_STARTUP_RUNS; run++) {
+            unsigned long long run_start = bench_now_ns();
+            pid_t pid;
+            int status;
+            int err = posix_spawn(&pid, progs[i], &actions, NULL, argv,
+                                  environ);
+            if (err != 0) {
+                errno = err;
+                goto out;
+            }
+            if (waitpid(pid, &status, 0) < 0) {
+                goto out;
+            }
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                errno = ECHILD;
+                goto out;
+            }
+            lat[run] = bench_now_ns() - run_start;
+        }
+        unsigned long long elapsed = bench_now_ns() - start;
+
+        qsort(lat, BENCH_STARTUP_RUNS, sizeof(*lat), bench_cmp);
+        printf("{\"program\":\"%s\",\"runs\":%d,\"mean_us\":%.1f,"
+               "\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+               progs[i], BENCH_STARTUP_RUNS,
+               elapsed / 1e3 / BENCH_STARTUP_RUNS,
+               lat[BENCH_STARTUP_RUNS / 2] / 1e3,
+               lat[BENCH_STARTUP_RUNS * 99 / 100] / 1e3);
+        fflush(stdout);
+    }
+    ret = 0;
+
+out:;
+    int saved_errno = errno;
+    posix_spawn_file_actions_destroy(&actions);
+    free(lat);
+    errno = saved_errno;
+    return ret;
+}
+
+/**
+ * @brief Compare two differences in throughput, for qsort()
+ * @param a First difference
+ * @param b Second difference
+ * @return Negative, zero or positive as a is less, equal or greater than b
+ */
+static int bench_cmp_delta(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/** Throughput of one kernel, corpus and size read back from --bench */
+struct bench_result {
+    char *id;    /**< JSON fields naming the result, up to "gbps" */
+    double gbps; /**< Throughput in GB/s */
+};
+
+/**
+ * @brief Free the results read back from a program
+ * @param results   Results to free
+ * @param n         Number of results
+ */
+static void bench_results_free(struct bench_result *results, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        free(results[i].id);
+    }
+    free(results);
+}
+
+/**
+ * @brief Run a program's --bench and read back the throughput of each result
+ * @param prog      Path of the program to run
+ * @param arg       --bench argument to run it with
+ * @param results   Where to store the newly allocated results
+ * @param n         Where to store the number of results
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int bench_collect(const char *prog, char *arg,
+                         struct bench_result **results, size_t *n)
+{
+    *results = NULL;
+    *n = 0;
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    char *argv[] = {(char *)prog, arg, NULL};
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err == 0) {
+        err = posix_spawn_file_actions_adddup2(&actions, pipefd[1],
+                                               STDOUT_FILENO);
+        if (err == 0) {
+            err = posix_spawn(&pid, prog, &actions, NULL, argv, environ);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    close(pipefd[1]);
+    if (err != 0) {
+        close(pipefd[0]);
+        errno = err;
+        return -1;
+    }
+
+    FILE *in = fdopen(pipefd[0], "r");
+    if (in == NULL) {
+        err = errno;
+        close(pipefd[0]);
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t cap = 0;
+    // After a failure, keep reading so the program does not block on a full
+    // pipe before it can be waited for
+    while (in != NULL && getline(&line, &line_size, in) >= 0) {
+        char *gbps = strstr(line, "\"gbps\":");
+        if (err != 0 || line[0] != '{' || gbps == NULL) {
+            continue;
+        }
+        if (*n == cap) {
+            size_t new_cap = cap > 0 ? cap * 2 : 64;
+            struct bench_result *grown =
+                realloc(*results, new_cap * sizeof(**results));
+            if (grown == NULL) {
+                err = errno;
+                continue;
+            }
+            *results = grown;
+            cap = new_cap;
+        }
+        char *id = strndup(line + 1, gbps - (line + 1));
+        if (id == NULL) {
+            err = errno;
+            continue;
+        }
+        (*results)[(*n)++] = (struct bench_result){
+            .id = id,
+            .gbps = strtod(gbps + strlen("\"gbps\":"), NULL),
+        };
+    }
+    if (in != NULL && ferror(in) && err == 0) {
+        err = errno;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        err = err != 0 ? err : errno;
+    } else if ((!WIFEXITED(status) || WEXITSTATUS(status) != 0) && err == 0) {
+        err = ECHILD;
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    free(line);
+    if (err != 0) {
+        bench_results_free(*results, *n);
+        *results = NULL;
+        *n = 0;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int bench_compare(char *const progs[], size_t nprogs, size_t max_size)
+{
+    char arg[32];
+    snprintf(arg, sizeof(arg), "--bench=%zu", max_size);
+
+    struct bench_result *base;
+    size_t nbase;
+    if (bench_collect(progs[0], arg, &base, &nbase) < 0) {
+        return -1;
+    }
+
+    for (size_t i = 1; i < nprogs; i++) {
+        struct bench_result *results;
+        size_t n;
+        if (bench_collect(progs[i], arg, &results, &n) < 0) {
+            int saved_errno = errno;
+            bench_results_free(base, nbase);
+            errno = saved_errno;
+            return -1;
+        }
+
+        // Only results both programs have are compared
+        double *deltas = malloc((n > 0 ? n : 1) * sizeof(*deltas));
+        if (deltas == NULL) {
+            bench_results_free(results, n);
+            bench_results_free(base, nbase);
+            return -1;
+        }
+        size_t ncompared = 0;
+        for (size_t j = 0; j < n; j++) {
+            const struct bench_result *b = NULL;
+            for (size_t k = 0; k < nbase && b == NULL; k++) {
+                if (strcmp(base[k].id, results[j].id) == 0) {
+                    b = &base[k];
+                }
+            }
+            if (b == NULL || b->gbps <= 0) {
+                continue;
+            }
+            double delta = (results[j].gbps / b->gbps - 1) * 100;
+            printf("{\"program\":\"%s\",%s\"gbps\":%.3f,"
+                   "\"baseline_gbps\":%.3f,\"delta_pct\":%.1f}\n",
+                   progs[i], results[j].id, results[j].gbps, b->gbps, delta);
+            deltas[ncompared++] = delta;
+        }
+
+        // The median is not thrown off by the odd noisy small size
+        qsort(deltas, ncompared, sizeof(*deltas), bench_cmp_delta);
+        printf("{\"program\":\"%s\",\"baseline\":\"%s\",\"results\":%zu,"
+               "\"median_delta_pct\":%.1f}\n",
+               progs[i], progs[0], ncompared,
+               ncompared > 0 ? deltas[ncompared / 2] : 0);
+        fflush(stdout);
+        free(deltas);
+        bench_results_free(results, n);
+    }
+
+    bench_results_free(base, nbase);
+    return 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file bench.h
+ * Benchmark harness for the kernels and stream engines.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+
+/** Largest size benchmarked by --bench without an argument */
+#define DEFAULT_BENCH_MAX (32 * 1024 * 1024)
+
+/**
+ * @brief Benchmark every kernel and stream engine on synthetic corpora
+ *
+ * Sizes go up by a factor of 32 from 1 KiB to max_size. Each kernel is timed
+ * one call at a time on buffers of up to BENCH_CALL_MAX bytes, so larger
+ * sizes are made up of several calls on the same cache-sized buffer. The
+ * stream engines read an in-memory file of the full size and write to
+ * /dev/null. Results are printed as one JSON object per line.
+ *
+ * @param max_size  Largest size to benchmark
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int bench(size_t max_size);
+
+/**
+ * @brief Benchmark the time programs take to crypt a short argv message
+ *
+ * Each program is run BENCH_STARTUP_RUNS times as `prog -e 13 msg` with its
+ * output sent to /dev/null, so the time measured is dominated by starting up
+ * and exiting. Results are printed as one JSON object per program.
+ *
+ * @param progs     Paths of the programs to run
+ * @param nprogs    Number of programs
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int bench_startup(char *const progs[], size_t nprogs);
+
+/**
+ * @brief Compare the --bench throughput of programs against a baseline
+ *
+ * Each program is run in turn as `prog --bench=max_size`, and every result
+ * it shares with the first program, the baseline, is printed as a line of
+ * JSON with both throughputs and the difference in percent. Each program
+ * after the baseline ends with a line giving the median difference over its
+ * results, so builds of the same source can be ranked on one machine.
+ *
+ * @param progs     Paths of the programs to run, the baseline first
+ * @param nprogs    Number of programs, at least 2
+ * @param max_size  Largest size to benchmark
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int bench_compare(char *const progs[], size_t nprogs, size_t max_size);
+
+#endif
@@ -0,0 +1,1106 @@
+/**
+ * @file caesar.c
+ * Caesar cipher library.
+ */
+#include "caesar.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+static const int ALPHABET_SIZE = CAESAR_ALPHABET_SIZE;
+
+/*
+ * Building with -DCAESAR_FIXED_SHIFT=N (`make KEY=N`) adds copies of the
+ * vector kernels with that shift as a compile-time constant. Keys reducing to
+ * the same right-shift pick them automatically.
+ */
+#ifdef CAESAR_FIXED_SHIFT
+#define FIXED_SHIFT                                                            \
+    (((CAESAR_FIXED_SHIFT) % CAESAR_ALPHABET_SIZE + CAESAR_ALPHABET_SIZE) %    \
+     CAESAR_ALPHABET_SIZE)
+#endif
+
+/** Inline a kernel body into each kernel so its shift can be a constant */
+#define KERNEL_BODY static inline __attribute__((always_inline))
+
+/**
+ * @brief Crypt a single character with the given shift and alphabet base
+ * @param shift Number of characters to logically right-shift, in [0, 26)
+ * @param base  Base character of alphabet, i.e. 'a' or 'A'
+ * @param c     Character to shift
+ * @return Shifted character
+ */
+static char crypt_char_base(int shift, char base, char c)
+{
+    // Shifts are reduced when a key is prepared, so one wrap is enough
+    int tgt_offset = c - base + shift;
+    if (tgt_offset >= ALPHABET_SIZE) {
+        tgt_offset -= ALPHABET_SIZE;
+    }
+    return base + tgt_offset;
+}
+
+/**
+ * @brief Crypt a single ASCII character
+ * @param shift Number of characters to logically right-shift, in [0, 26)
+ * @param c     Character to shift
+ * @return Crypted character, or the same character if not alphabetic
+ */
+static char crypt_char(int shift, char c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        return crypt_char_base(shift, 'A', c);
+    }
+    if (c >= 'a' && c <= 'z') {
+        return crypt_char_base(shift, 'a', c);
+    }
+
+    return c;
+}
+
+/*
+ * Every kernel must produce exactly the same output as crypt_buf_reference().
+ */
+
+/**
+ * @brief Crypt a buffer one character at a time with crypt_char()
+ * @param key   Prepared key
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ */
+static void crypt_buf_reference(const struct caesar_key *key, const uint8_t *in,
+                                uint8_t *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        out[i] = crypt_char(key->shift, in[i]);
+    }
+}
+
+/**
+ * @brief Crypt a buffer one byte at a time using the translation table
+ * @param key   Prepared key
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ */
+static void crypt_buf_table(const struct caesar_key *key, const uint8_t *in,
+                            uint8_t *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        out[i] = key->map[in[i]];
+    }
+}
+
+/*
+ * The vector kernels all use the same branchless scheme. Setting bit 5 folds
+ * upper case onto lower case, so a byte is alphabetic if the folded value t is
+ * in ['a', 'z']. Adding the shift wraps past 'z' exactly when
+ * t > 'a' + ALPHABET_SIZE - 1 - shift, in which case ALPHABET_SIZE is
+ * subtracted again. Non-alphabetic bytes get a zero delta. Bytes with the high
+ * bit set compare as negative with the signed x86 compares, so they are never
+ * considered alphabetic.
+ */
+
+/*
+ * Each vector kernel is split into a body crypting whole vectors, which
+ * returns the number of bytes it crypted, and a wrapper finishing the tail
+ * with narrower vectors and the table.
+ */
+
+#ifdef HAVE_X86_SIMD
+/**
+ * @brief Crypt the whole 16-byte vectors of a buffer with SSE2
+ * @param k     Right-shift in [0, 26)
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ * @return Number of bytes crypted
+ */
+__attribute__((target("sse2"))) KERNEL_BODY size_t
+crypt_vec_sse2(int k, const uint8_t *in, uint8_t *out, size_t n)
+{
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i before_a = _mm_set1_epi8('a' - 1);
+    const __m128i after_z = _mm_set1_epi8('z' + 1);
+    const __m128i wrap_at = _mm_set1_epi8('a' + ALPHABET_SIZE - 1 - k);
+    const __m128i shift = _mm_set1_epi8(k);
+    const __m128i size = _mm_set1_epi8(ALPHABET_SIZE);
+
+    size_t i = 0;
+    for (; i + sizeof(__m128i) <= n; i += sizeof(__m128i)) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i t = _mm_or_si128(v, fold);
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(t, before_a),
+                                      _mm_cmpgt_epi8(after_z, t));
+        __m128i wrap = _mm_and_si128(_mm_cmpgt_epi8(t, wrap_at), size);
+        __m128i delta = _mm_and_si128(alpha, _mm_sub_epi8(shift, wrap));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_add_epi8(v, delta));
+    }
+
+    return i;
+}
+
+/**
+ * @brief Crypt the whole 32-byte vectors of a buffer with AVX2
+ * @param k     Right-shift in [0, 26)
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ * @return Number of bytes crypted
+ */
+__attribute__((target("avx2"))) KERNEL_BODY size_t
+crypt_vec_avx2(int k, const uint8_t *in, uint8_t *out, size_t n)
+{
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    const __m256i before_a = _mm256_set1_epi8('a' - 1);
+    const __m256i after_z = _mm256_set1_epi8('z' + 1);
+    const __m256i wrap_at = _mm256_set1_epi8('a' + ALPHABET_SIZE - 1 - k);
+    const __m256i shift = _mm256_set1_epi8(k);
+    const __m256i size = _mm256_set1_epi8(ALPHABET_SIZE);
+
+    size_t i = 0;
+    for (; i + sizeof(__m256i) <= n; i += sizeof(__m256i)) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i t = _mm256_or_si256(v, fold);
+        __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(t, before_a),
+                                         _mm256_cmpgt_epi8(after_z, t));
+        __m256i wrap = _mm256_and_si256(_mm256_cmpgt_epi8(t, wrap_at), size);
+        __m256i delta = _mm256_and_si256(alpha, _mm256_sub_epi8(shift, wrap));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi8(v, delta));
+    }
+
+    return i;
+}
+
+/**
+ * @brief Crypt the whole 64-byte vectors of a buffer with AVX-512BW
+ * @param k     Right-shift in [0, 26)
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ * @return Number of bytes crypted
+ */
+__attribute__((target("avx512f,avx512bw"))) KERNEL_BODY size_t
+crypt_vec_avx512(int k, const uint8_t *in, uint8_t *out, size_t n)
+{
+    const __m512i fold = _mm512_set1_epi8(0x20);
+    const __m512i before_a = _mm512_set1_epi8('a' - 1);
+    const __m512i after_z = _mm512_set1_epi8('z' + 1);
+    const __m512i wrap_at = _mm512_set1_epi8('a' + ALPHABET_SIZE - 1 - k);
+    const __m512i unwrapped = _mm512_set1_epi8(k);
+    const __m512i wrapped = _mm512_set1_epi8(k - ALPHABET_SIZE);
+
+    size_t i = 0;
+    for (; i + sizeof(__m512i) <= n; i += sizeof(__m512i)) {
+        __m512i v = _mm512_loadu_si512(in + i);
+        __m512i t = _mm512_or_si512(v, fold);
+        __mmask64 alpha = _mm512_cmpgt_epi8_mask(t, before_a) &
+                          _mm512_cmpgt_epi8_mask(after_z, t);
+        __mmask64 wrap = _mm512_cmpgt_epi8_mask(t, wrap_at);
+        __m512i delta = _mm512_mask_blend_epi8(wrap, unwrapped, wrapped);
+        _mm512_storeu_si512(out + i, _mm512_mask_add_epi8(v, alpha, v, delta));
+    }
+
+    return i;
+}
+
+/**
+ * @brief Define the x86 kernels for a shift
+ * @param suffix    Suffix of the kernel names
+ * @param k         Expression giving the right-shift, from the key named key
+ */
+#define DEFINE_X86_KERNELS(suffix, k)                                          \
+    __attribute__((target("sse2"))) static void crypt_buf_sse2##suffix(        \
+        const struct caesar_key *key, const uint8_t *in, uint8_t *out,         \
+        size_t n)                                                              \
+    {                                                                          \
+        size_t i = crypt_vec_sse2(k, in, out, n);                              \
+        crypt_buf_table(key, in + i, out + i, n - i);                          \
+    }                                                                          \
+                                                                               \
+    __attribute__((target("avx2"))) static void crypt_buf_avx2##suffix(        \
+        const struct caesar_key *key, const uint8_t *in, uint8_t *out,         \
+        size_t n)                                                              \
+    {                                                                          \
+        size_t i = crypt_vec_avx2(k, in, out, n);                              \
+        i += crypt_vec_sse2(k, in + i, out + i, n - i);                        \
+        crypt_buf_table(key, in + i, out + i, n - i);                          \
+    }                                                                          \
+                                                                               \
+    __attribute__((target("avx512f,avx512bw"))) static void                    \
+        crypt_buf_avx512##suffix(const struct caesar_key *key,                 \
+                                 const uint8_t *in, uint8_t *out, size_t n)    \
+    {                                                                          \
+        size_t i = crypt_vec_avx512(k, in, out, n);                            \
+        i += crypt_vec_avx2(k, in + i, out + i, n - i);                        \
+        i += crypt_vec_sse2(k, in + i, out + i, n - i);                        \
+        crypt_buf_table(key, in + i, out + i, n - i);                          \
+    }
+
+DEFINE_X86_KERNELS(, key->shift)
+#ifdef FIXED_SHIFT
+DEFINE_X86_KERNELS(_fixed, FIXED_SHIFT)
+#endif
+
+/**
+ * @brief Crypt a buffer 64 bytes at a time by looking up the translation
+ *        table with AVX-512VBMI, which works for any alphabet
+ * @param key   Prepared key
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ */
+__attribute__((target("avx512f,avx512bw,avx512vbmi"))) static void
+crypt_buf_vbmi(const struct caesar_key *key, const uint8_t *in, uint8_t *out,
+               size_t n)
+{
+    // Each two-register permute looks up 128 entries by the low 7 bits of
+    // the index, so the high bit picks between the two halves of the map
+    const __m512i map0 = _mm512_loadu_si512(key->map);
+    const __m512i map1 = _mm512_loadu_si512(key->map + 64);
+    const __m512i map2 = _mm512_loadu_si512(key->map + 128);
+    const __m512i map3 = _mm512_loadu_si512(key->map + 192);
+
+    size_t i = 0;
+    for (; i + sizeof(__m512i) <= n; i += sizeof(__m512i)) {
+        __m512i v = _mm512_loadu_si512(in + i);
+        __m512i low = _mm512_permutex2var_epi8(map0, v, map1);
+        __m512i high = _mm512_permutex2var_epi8(map2, v, map3);
+        _mm512_storeu_si512(
+            out + i, _mm512_mask_blend_epi8(_mm512_movepi8_mask(v), low, high));
+    }
+
+    crypt_buf_table(key, in + i, out + i, n - i);
+}
+#endif
+
+#ifdef HAVE_NEON
+/**
+ * @brief Crypt the whole 16-byte vectors of a buffer with NEON
+ * @param k     Right-shift in [0, 26)
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ * @return Number of bytes crypted
+ */
+KERNEL_BODY size_t crypt_vec_neon(int k, const uint8_t *in, uint8_t *out,
+                                  size_t n)
+{
+    const uint8x16_t fold = vdupq_n_u8(0x20);
+    const uint8x16_t lower_a = vdupq_n_u8('a');
+    const uint8x16_t lower_z = vdupq_n_u8('z');
+    const uint8x16_t wrap_at = vdupq_n_u8('a' + ALPHABET_SIZE - 1 - k);
+    const uint8x16_t shift = vdupq_n_u8(k);
+    const uint8x16_t size = vdupq_n_u8(ALPHABET_SIZE);
+
+    size_t i = 0;
+    for (; i + sizeof(uint8x16_t) <= n; i += sizeof(uint8x16_t)) {
+        uint8x16_t v = vld1q_u8(in + i);
+        uint8x16_t t = vorrq_u8(v, fold);
+        uint8x16_t alpha = vandq_u8(vcgeq_u8(t, lower_a), vcleq_u8(t, lower_z));
+        uint8x16_t wrap = vandq_u8(vcgtq_u8(t, wrap_at), size);
+        uint8x16_t delta = vandq_u8(alpha, vsubq_u8(shift, wrap));
+        vst1q_u8(out + i, vaddq_u8(v, delta));
+    }
+
+    return i;
+}
+
+/**
+ * @brief Define the NEON kernel for a shift
+ * @param suffix    Suffix of the kernel name
+ * @param k         Expression giving the right-shift, from the key named key
+ */
+#define DEFINE_NEON_KERNELS(suffix, k)                                         \
+    static void crypt_buf_neon##suffix(const struct caesar_key *key,           \
+                                       const uint8_t *in, uint8_t *out,        \
+                                       size_t n)                               \
+    {                                                                          \
+        size_t i = crypt_vec_neon(k, in, out, n);                              \
+        crypt_buf_table(key, in + i, out + i, n - i);                          \
+    }
+
+DEFINE_NEON_KERNELS(, key->shift)
+#ifdef FIXED_SHIFT
+DEFINE_NEON_KERNELS(_fixed, FIXED_SHIFT)
+#endif
+#endif
+
+/*
+ * Keyword kernels crypt each byte by the shift of its position in the
+ * schedule, which repeats the keyword's shifts with enough slack after one
+ * period that a whole vector of shifts can be loaded starting at any phase.
+ * The vector kernels use the same scheme as above, with the shifts and wrap
+ * points varying per lane.
+ */
+
+/**
+ * @brief Crypt a buffer one character at a time with a keyword schedule
+ * @param key   Prepared keyword key
+ * @param phase Position of the first byte in the schedule, below key->period
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ */
+static void crypt_schedule_reference(const struct caesar_key *key,
+                                     size_t phase, const uint8_t *in,
+                                     uint8_t *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        out[i] = crypt_char(key->schedule[phase], in[i]);
+        if (++phase == key->period) {
+            phase = 0;
+        }
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+ * @brief Crypt a buffer with a keyword schedule 16 bytes at a time with SSE2
+ * @param key   Prepared keyword key
+ * @param phase Position of the first byte in the schedule, below key->period
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ */
+__attribute__((target("sse2"))) static void
+crypt_schedule_sse2(const struct caesar_key *key, size_t phase,
+                    const uint8_t *in, uint8_t *out, size_t n)
+{
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i before_a = _mm_set1_epi8('a' - 1);
+    const __m128i after_z = _mm_set1_epi8('z' + 1);
+    const __m128i last = _mm_set1_epi8('a' + ALPHABET_SIZE - 1);
+    const __m128i size = _mm_set1_epi8(ALPHABET_SIZE);
+    const size_t step = sizeof(__m128i) % key->period;
+
+    size_t i = 0;
+    for (; i + sizeof(__m128i) <= n; i += sizeof(__m128i)) {
+        __m128i shift =
+            _mm_loadu_si128((const __m128i *)(key->schedule + phase));
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i t = _mm_or_si128(v, fold);
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(t, before_a),
+                                      _mm_cmpgt_epi8(after_z, t));
+        __m128i wrap = _mm_and_si128(
+            _mm_cmpgt_epi8(t, _mm_sub_epi8(last, shift)), size);
+        __m128i delta = _mm_and_si128(alpha, _mm_sub_epi8(shift, wrap));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_add_epi8(v, delta));
+
+        phase += step;
+        if (phase >= key->period) {
+            phase -= key->period;
+        }
+    }
+
+    crypt_schedule_reference(key, phase, in + i, out + i, n - i);
+}
+
+/**
+ * @brief Crypt a buffer with a keyword schedule 32 bytes at a time with AVX2
+ * @param key   Prepared keyword key
+ * @param phase Position of the first byte in the schedule, below key->period
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ */
+__attribute__((target("avx2"))) static void
+crypt_schedule_avx2(const struct caesar_key *key, size_t phase,
+                    const uint8_t *in, uint8_t *out, size_t n)
+{
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    const __m256i before_a = _mm256_set1_epi8('a' - 1);
+    const __m256i after_z = _mm256_set1_epi8('z' + 1);
+    const __m256i last = _mm256_set1_epi8('a' + ALPHABET_SIZE - 1);
+    const __m256i size = _mm256_set1_epi8(ALPHABET_SIZE);
+    const size_t step = sizeof(__m256i) % key->period;
+
+    size_t i = 0;
+    for (; i + sizeof(__m256i) <= n; i += sizeof(__m256i)) {
+        __m256i shift =
+            _mm256_loadu_si256((const __m256i *)(key->schedule + phase));
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i t = _mm256_or_si256(v, fold);
+        __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(t, before_a),
+                                         _mm256_cmpgt_epi8(after_z, t));
+        __m256i wrap = _mm256_and_si256(
+            _mm256_cmpgt_epi8(t, _mm256_sub_epi8(last, shift)), size);
+        __m256i delta = _mm256_and_si256(alpha, _mm256_sub_epi8(shift, wrap));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi8(v, delta));
+
+        phase += step;
+        if (phase >= key->period) {
+            phase -= key->period;
+        }
+    }
+
+    crypt_schedule_sse2(key, phase, in + i, out + i, n - i);
+}
+
+/**
+ * @brief Crypt a buffer with a keyword schedule 64 bytes at a time with
+ *        AVX-512BW
+ * @param key   Prepared keyword key
+ * @param phase Position of the first byte in the schedule, below key->period
+ * @param in    Bytes to crypt
+ * @param out   Buffer to write the result to
+ * @param n     Number of bytes to crypt
+ */
+__attribute__((target("avx512f,avx512bw"))) static void
+crypt_schedule_avx512(const struct caesar_key *key, size_t phase,
+                      const uint8_t *in, uint8_t *out, size_t n)
+{
+    const __m512i fold = _mm512_set1_epi8(0x20);
+    const __m512i before_a = _mm512_set1_epi8('a' - 1);
+    const __m512i after_z = _mm512_set1_epi8('z' + 1);
+    const __m512i last = _mm512_set1_epi8('a' + ALPHABET_SIZE - 1);
+    const __m512i size = _mm512_set1_epi8(ALPHABET_SIZE);
+    const size_t step = sizeof(__m512i) % key->period;
+
+    size_t i = 0;
+    for (; i + sizeof(__m512i) <= n; i += sizeof(__m512i)) {
+        __m512i shift = _mm512_loadu_si512(key->schedule + phase);
+        __m512i v = _mm512_loadu_si512(in + i);
+        __m512i t = _mm512_or_si512(v, fold);
+        __mmask64 alpha = _mm512_cmpgt_epi8_mask(t, before_a) &
+                          _mm512_cmpgt_epi8_mask(after_z, t);
+        __mmask64 wrap =
+            _mm512_cmpgt_epi8_mask(t, _mm512_sub_epi8(last, shift));
+        __m512i delta = _mm512_mask_sub_epi8(shift, wrap, shift, size);
+        _mm512_storeu_si512(out + i, _mm512_mask_add_epi8(v, alpha, v, delta));
+
+        phase += step;
+        if (phase >= key->period) {
+            phase -= key->period;
+        }
+    }
+
+    crypt_schedule_avx2(key, phase, in + i, out + i, n - i);
+}
+#endif
+
+/** Implementation of each kernel, or NULL if not built for this target */
+static const caesar_kernel_fn KERNELS[CAESAR_KERNEL_COUNT] = {
+    [CAESAR_KERNEL_REFERENCE] = crypt_buf_reference,
+    [CAESAR_KERNEL_TABLE] = crypt_buf_table,
+#ifdef HAVE_X86_SIMD
+    [CAESAR_KERNEL_SSE2] = crypt_buf_sse2,
+    [CAESAR_KERNEL_AVX2] = crypt_buf_avx2,
+    [CAESAR_KERNEL_AVX512] = crypt_buf_avx512,
+    [CAESAR_KERNEL_VBMI] = crypt_buf_vbmi,
+#endif
+#ifdef HAVE_NEON
+    [CAESAR_KERNEL_NEON] = crypt_buf_neon,
+#endif
+};
+
+/**
+ * Implementation of each kernel for keyword keys, or NULL if it has none. A
+ * per-position table would not fit, so the scalar table kernel falls back to
+ * the reference.
+ */
+static const caesar_schedule_fn SCHEDULE_KERNELS[CAESAR_KERNEL_COUNT] = {
+    [CAESAR_KERNEL_REFERENCE] = crypt_schedule_reference,
+    [CAESAR_KERNEL_TABLE] = crypt_schedule_reference,
+#ifdef HAVE_X86_SIMD
+    [CAESAR_KERNEL_SSE2] = crypt_schedule_sse2,
+    [CAESAR_KERNEL_AVX2] = crypt_schedule_avx2,
+    [CAESAR_KERNEL_AVX512] = crypt_schedule_avx512,
+#endif
+};
+
+/** Kernels that work from the translation table alone, for any alphabet */
+static const bool TABLE_DRIVEN[CAESAR_KERNEL_COUNT] = {
+    [CAESAR_KERNEL_TABLE] = true,
+    [CAESAR_KERNEL_VBMI] = true,
+};
+
+/** Order in which caesar_key_init() tries kernels, fastest first */
+static const enum caesar_kernel PREFERRED[] = {
+    CAESAR_KERNEL_AVX512, CAESAR_KERNEL_VBMI, CAESAR_KERNEL_AVX2,
+    CAESAR_KERNEL_SSE2,   CAESAR_KERNEL_NEON, CAESAR_KERNEL_TABLE,
+};
+
+#ifdef FIXED_SHIFT
+/** Kernels specialized for FIXED_SHIFT, or NULL to use the generic one */
+static const caesar_kernel_fn FIXED_KERNELS[CAESAR_KERNEL_COUNT] = {
+#ifdef HAVE_X86_SIMD
+    [CAESAR_KERNEL_SSE2] = crypt_buf_sse2_fixed,
+    [CAESAR_KERNEL_AVX2] = crypt_buf_avx2_fixed,
+    [CAESAR_KERNEL_AVX512] = crypt_buf_avx512_fixed,
+#endif
+#ifdef HAVE_NEON
+    [CAESAR_KERNEL_NEON] = crypt_buf_neon_fixed,
+#endif
+};
+#endif
+
+/** Name of each kernel */
+static const char *const KERNEL_NAMES[CAESAR_KERNEL_COUNT] = {
+    [CAESAR_KERNEL_REFERENCE] = "reference",
+    [CAESAR_KERNEL_TABLE] = "table",
+    [CAESAR_KERNEL_SSE2] = "sse2",
+    [CAESAR_KERNEL_AVX2] = "avx2",
+    [CAESAR_KERNEL_AVX512] = "avx512",
+    [CAESAR_KERNEL_NEON] = "neon",
+    [CAESAR_KERNEL_VBMI] = "vbmi",
+};
+
+bool caesar_kernel_supported(enum caesar_kernel kernel)
+{
+    if (kernel >= CAESAR_KERNEL_COUNT || KERNELS[kernel] == NULL) {
+        return false;
+    }
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    switch (kernel) {
+    case CAESAR_KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case CAESAR_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case CAESAR_KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512bw");
+    case CAESAR_KERNEL_VBMI:
+        return __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("avx512vbmi");
+    default:
+        break;
+    }
+#endif
+
+    return true;
+}
+
+const char *caesar_kernel_name(enum caesar_kernel kernel)
+{
+    return kernel < CAESAR_KERNEL_COUNT ? KERNEL_NAMES[kernel] : "unknown";
+}
+
+int caesar_key_set_kernel(struct caesar_key *key, enum caesar_kernel kernel)
+{
+    if (!caesar_kernel_supported(kernel) ||
+        (!key->letters && !TABLE_DRIVEN[kernel]) ||
+        (key->period != 0 && SCHEDULE_KERNELS[kernel] == NULL)) {
+        return -1;
+    }
+
+    key->kernel = KERNELS[kernel];
+    key->schedule_kernel = SCHEDULE_KERNELS[kernel];
+#ifdef FIXED_SHIFT
+    if (key->letters && key->shift == FIXED_SHIFT &&
+        FIXED_KERNELS[kernel] != NULL) {
+        key->kernel = FIXED_KERNELS[kernel];
+    }
+#endif
+    return 0;
+}
+
+/**
+ * @brief Select the fastest kernel that can crypt a key
+ * @param key   Key with its map, shift and letters set
+ */
+static void select_kernel(struct caesar_key *key)
+{
+    // The scalar table at the end of the list always works
+    for (size_t i = 0; i < sizeof(PREFERRED) / sizeof(PREFERRED[0]); i++) {
+        if (caesar_key_set_kernel(key, PREFERRED[i]) == 0) {
+            break;
+        }
+    }
+}
+
+void caesar_key_init(struct caesar_key *key, long shift)
+{
+    // Reduce once here so that no kernel has to deal with large shifts
+    key->shift = (shift % ALPHABET_SIZE + ALPHABET_SIZE) % ALPHABET_SIZE;
+    for (int c = 0; c <= UCHAR_MAX; c++) {
+        key->map[c] = crypt_char(key->shift, c);
+    }
+    key->letters = true;
+    key->period = 0;
+
+    select_kernel(key);
+}
+
+int caesar_key_init_keyword(struct caesar_key *key, const char *keyword,
+                            bool decrypt)
+{
+    size_t period = strlen(keyword);
+    if (period == 0 || period > CAESAR_KEYWORD_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    caesar_key_init(key, 0);
+    for (size_t i = 0; i < period; i++) {
+        int c = keyword[i] | 0x20;
+        if (c < 'a' || c > 'z') {
+            errno = EINVAL;
+            return -1;
+        }
+        int shift = c - 'a';
+        key->schedule[i] = decrypt ? (ALPHABET_SIZE - shift) % ALPHABET_SIZE
+                                   : shift;
+    }
+    for (size_t i = period; i < period + CAESAR_SCHEDULE_SLACK; i++) {
+        key->schedule[i] = key->schedule[i - period];
+    }
+    key->period = period;
+
+    select_kernel(key);
+    return 0;
+}
+
+void caesar_key_advance(struct caesar_key *key, uint64_t n)
+{
+    if (key->period == 0) {
+        return;
+    }
+
+    uint8_t rotated[CAESAR_KEYWORD_MAX + CAESAR_SCHEDULE_SLACK];
+    size_t phase = n % key->period;
+    for (size_t i = 0; i < key->period + CAESAR_SCHEDULE_SLACK; i++) {
+        rotated[i] = key->schedule[(phase + i) % key->period];
+    }
+    memcpy(key->schedule, rotated, key->period + CAESAR_SCHEDULE_SLACK);
+}
+
+/**
+ * @brief Decode one UTF-8 sequence
+ * @param p     Bytes to decode
+ * @param n     Number of bytes available at p, at least 1
+ * @param cp    Set to the decoded code point
+ * @return Length of the sequence, or 0 if it is malformed or truncated
+ */
+static size_t utf8_decode(const uint8_t *p, size_t n, uint32_t *cp)
+{
+    static const uint32_t MIN_CP[] = {0, 0, 0x80, 0x800, 0x10000};
+
+    size_t len = p[0] < 0x80 ? 1 : p[0] < 0xc0 ? 0 : p[0] < 0xe0 ? 2
+               : p[0] < 0xf0 ? 3 : p[0] < 0xf8 ? 4 : 0;
+    if (len == 0 || len > n) {
+        return 0;
+    }
+
+    uint32_t value = len == 1 ? p[0] : p[0] & (0x7f >> len);
+    for (size_t i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        value = value << 6 | (p[i] & 0x3f);
+    }
+
+    // Reject overlong forms, surrogates and values past Unicode
+    if (value < MIN_CP[len] || (value >= 0xd800 && value <= 0xdfff) ||
+        value > 0x10ffff) {
+        return 0;
+    }
+
+    *cp = value;
+    return len;
+}
+
+/**
+ * @brief Get the length of the UTF-8 encoding of a code point
+ * @param cp    Code point
+ * @return Number of bytes in its encoding
+ */
+static size_t utf8_len(uint32_t cp)
+{
+    return cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+}
+
+/**
+ * @brief Encode a code point as UTF-8
+ * @param cp    Code point
+ * @param out   Buffer of utf8_len(cp) bytes to write the encoding to
+ */
+static void utf8_encode(uint32_t cp, uint8_t *out)
+{
+    static const uint8_t LEAD[] = {0, 0, 0xc0, 0xe0, 0xf0};
+
+    size_t len = utf8_len(cp);
+    if (len == 1) {
+        out[0] = cp;
+        return;
+    }
+    for (size_t i = len - 1; i > 0; i--) {
+        out[i] = 0x80 | (cp & 0x3f);
+        cp >>= 6;
+    }
+    out[0] = LEAD[len] | cp;
+}
+
+/** Most characters a single group of an alphabet specification may list */
+#define MAX_GROUP (CAESAR_UTF8_MAX + UCHAR_MAX + 1)
+
+/**
+ * @brief Parse one possibly escaped character of an alphabet specification
+ * @param spec  Specification, advanced past the character
+ * @param utf8  Whether unescaped characters are UTF-8 sequences, rather than
+ *              single bytes
+ * @return Code point or byte value of the character, or -1 if it is
+ *         malformed
+ */
+static long parse_alphabet_char(const char **spec, bool utf8)
+{
+    const char *p = *spec;
+    if (*p != '\\') {
+        uint32_t cp = (unsigned char)*p;
+        size_t len = utf8 ? utf8_decode((const uint8_t *)p, strlen(p), &cp) : 1;
+        if (len == 0) {
+            return -1;
+        }
+        *spec = p + len;
+        return cp;
+    }
+
+    if (p[1] == ',' || p[1] == '-' || p[1] == '\\') {
+        *spec = p + 2;
+        return (unsigned char)p[1];
+    }
+
+    if (p[1] == 'x') {
+        int value = 0;
+        for (int i = 2; i < 4; i++) {
+            int c = p[i];
+            if (c >= '0' && c <= '9') {
+                value = value * 16 + c - '0';
+            } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+                value = value * 16 + (c | 0x20) - 'a' + 10;
+            } else {
+                return -1;
+            }
+        }
+        *spec = p + 4;
+        return value;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Parse the next group of an alphabet specification
+ * @param spec  Specification, advanced up to the comma or NUL ending the group
+ * @param utf8  Whether unescaped characters are UTF-8 sequences
+ * @param group Buffer of MAX_GROUP entries to store the group's characters in
+ * @return Number of characters in the group, or -1 if it is empty, malformed
+ *         or too large
+ */
+static long parse_alphabet_group(const char **spec, bool utf8, uint32_t *group)
+{
+    const char *p = *spec;
+    long len = 0;
+    while (*p != '\0' && *p != ',') {
+        long first = parse_alphabet_char(&p, utf8);
+        long last = first;
+        if (first >= 0 && *p == '-' && p[1] != '\0' && p[1] != ',') {
+            p++;
+            last = parse_alphabet_char(&p, utf8);
+        }
+        if (first < 0 || last < first || last - first >= MAX_GROUP - len) {
+            return -1;
+        }
+        for (long c = first; c <= last; c++) {
+            group[len++] = c;
+        }
+    }
+
+    *spec = p;
+    return len > 0 ? len : -1;
+}
+
+/**
+ * @brief Add the rotation of a group of bytes to a translation table
+ * @param map   Translation table
+ * @param seen  Which bytes are already in a group, updated
+ * @param group Bytes of the group, in order
+ * @param len   Number of bytes in the group
+ * @param shift Number of characters to logically right-shift
+ * @return 0 on success, or -1 if a byte is already in a group
+ */
+static int rotate_bytes(uint8_t *map, bool *seen, const uint32_t *group,
+                        long len, long shift)
+{
+    long reduced = ((shift % len) + len) % len;
+    for (long i = 0; i < len; i++) {
+        if (seen[group[i]]) {
+            return -1;
+        }
+        seen[group[i]] = true;
+        map[group[i]] = group[(i + reduced) % len];
+    }
+    return 0;
+}
+
+/**
+ * @brief Prepare a key from a translation table
+ * @param key   Key to initialize
+ * @param shift Shift the table was built for
+ * @param map   Translation table
+ */
+static void key_init_map(struct caesar_key *key, long shift, const uint8_t *map)
+{
+    // Alphabets crypting like the default one keep the arithmetic kernels
+    caesar_key_init(key, shift);
+    if (memcmp(key->map, map, sizeof(key->map)) != 0) {
+        memcpy(key->map, map, sizeof(key->map));
+        key->letters = false;
+        select_kernel(key);
+    }
+}
+
+int caesar_key_init_alphabet(struct caesar_key *key, long shift,
+                             const char *alphabet)
+{
+    uint8_t map[UCHAR_MAX + 1];
+    bool seen[UCHAR_MAX + 1] = {false};
+    for (int c = 0; c <= UCHAR_MAX; c++) {
+        map[c] = c;
+    }
+
+    uint32_t group[MAX_GROUP];
+    const char *p = alphabet;
+    while (true) {
+        long len = parse_alphabet_group(&p, false, group);
+        if (len < 0 || rotate_bytes(map, seen, group, len, shift) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        p++;
+    }
+
+    key_init_map(key, shift, map);
+    return 0;
+}
+
+long caesar_alphabet_period(const char *alphabet, bool utf8)
+{
+    uint32_t group[MAX_GROUP];
+    long period = 1;
+    const char *p = alphabet;
+    while (true) {
+        long len = parse_alphabet_group(&p, utf8, group);
+        if (len < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        // Least common multiple of the group lengths so far
+        long a = period;
+        long b = len;
+        while (b != 0) {
+            long t = a % b;
+            a = b;
+            b = t;
+        }
+        if (period / a > LONG_MAX / len) {
+            errno = EOVERFLOW;
+            return -1;
+        }
+        period = period / a * len;
+
+        if (*p == '\0') {
+            break;
+        }
+        p++;
+    }
+
+    return period;
+}
+
+/**
+ * @brief Compare UTF-8 key entries by source code point, for qsort()
+ * @param a First entry
+ * @param b Second entry
+ * @return Negative, zero or positive as a sorts before, with or after b
+ */
+static int compare_utf8_entry(const void *a, const void *b)
+{
+    const uint32_t *x = a;
+    const uint32_t *y = b;
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+int caesar_utf8_key_init(struct caesar_utf8_key *key, long shift,
+                         const char *alphabet)
+{
+    uint8_t map[UCHAR_MAX + 1];
+    bool seen[UCHAR_MAX + 1] = {false};
+    for (int c = 0; c <= UCHAR_MAX; c++) {
+        map[c] = c;
+    }
+    key->n = 0;
+
+    uint32_t group[MAX_GROUP];
+    const char *p = alphabet;
+    while (true) {
+        long len = parse_alphabet_group(&p, true, group);
+        if (len < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        // Rotating must not change the length of the encoding, so that
+        // buffers can be crypted in place
+        size_t enc_len = utf8_len(group[0]);
+        for (long i = 1; i < len; i++) {
+            if (utf8_len(group[i]) != enc_len) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+
+        if (enc_len == 1) {
+            if (rotate_bytes(map, seen, group, len, shift) < 0) {
+                errno = EINVAL;
+                return -1;
+            }
+        } else {
+            if ((size_t)len > CAESAR_UTF8_MAX - key->n) {
+                errno = EINVAL;
+                return -1;
+            }
+            long reduced = ((shift % len) + len) % len;
+            for (long i = 0; i < len; i++) {
+                key->map[key->n][0] = group[i];
+                key->map[key->n][1] = group[(i + reduced) % len];
+                key->n++;
+            }
+        }
+
+        if (*p == '\0') {
+            break;
+        }
+        p++;
+    }
+
+    qsort(key->map, key->n, sizeof(key->map[0]), compare_utf8_entry);
+    for (size_t i = 1; i < key->n; i++) {
+        if (key->map[i][0] == key->map[i - 1][0]) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    key_init_map(&key->ascii, shift, map);
+    return 0;
+}
+
+/**
+ * @brief Find the next byte with the high bit set, 8 bytes at a time
+ * @param buf   Buffer to scan
+ * @param i     Offset to start at
+ * @param n     Size of the buffer
+ * @return Offset of the next non-ASCII byte, or n if there is none
+ */
+static size_t skip_ascii(const uint8_t *buf, size_t i, size_t n)
+{
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        if (word & 0x8080808080808080) {
+            break;
+        }
+    }
+    while (i < n && buf[i] < 0x80) {
+        i++;
+    }
+    return i;
+}
+
+void caesar_utf8_transform_inplace(const struct caesar_utf8_key *key,
+                                   uint8_t *buf, size_t n)
+{
+    // The ASCII table leaves every byte with the high bit set alone, so
+    // multi-byte sequences survive it and whole blocks can go through the
+    // vector kernels
+    caesar_transform_inplace(&key->ascii, buf, n);
+    if (key->n == 0) {
+        return;
+    }
+
+    for (size_t i = skip_ascii(buf, 0, n); i < n; i = skip_ascii(buf, i, n)) {
+        uint32_t cp;
+        size_t len = utf8_decode(buf + i, n - i, &cp);
+        if (len == 0) {
+            // Leave malformed bytes as they are
+            i++;
+            continue;
+        }
+
+        size_t lo = 0;
+        size_t hi = key->n;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (key->map[mid][0] < cp) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < key->n && key->map[lo][0] == cp) {
+            utf8_encode(key->map[lo][1], buf + i);
+        }
+        i += len;
+    }
+}
+
+size_t caesar_utf8_boundary(const uint8_t *buf, size_t n)
+{
+    // Find the lead byte of the last sequence
+    size_t lead = n;
+    while (lead > 0 && n - lead < 4 && (buf[lead - 1] & 0xc0) == 0x80) {
+        lead--;
+    }
+    if (lead == 0 || n - lead >= 4) {
+        return n;
+    }
+    lead--;
+
+    uint8_t c = buf[lead];
+    size_t len = c < 0xc0 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : c < 0xf8 ? 4 : 1;
+    return n - lead < len ? lead : n;
+}
+
+void caesar_transform(const struct caesar_key *key, const uint8_t *in,
+                      uint8_t *out, size_t n)
+{
+    caesar_transform_at(key, 0, in, out, n);
+}
+
+void caesar_transform_inplace(const struct caesar_key *key, uint8_t *buf,
+                              size_t n)
+{
+    caesar_transform_at(key, 0, buf, buf, n);
+}
+
+void caesar_transform_at(const struct caesar_key *key, uint64_t pos,
+                         const uint8_t *in, uint8_t *out, size_t n)
+{
+    if (key->period == 0) {
+        key->kernel(key, in, out, n);
+    } else {
+        key->schedule_kernel(key, pos % key->period, in, out, n);
+    }
+}
+
+void caesar_transform_inplace_at(const struct caesar_key *key, uint64_t pos,
+                                 uint8_t *buf, size_t n)
+{
+    caesar_transform_at(key, pos, buf, buf, n);
+}
@@ -0,0 +1,273 @@
+/**
+ * @file caesar.h
+ * Caesar cipher library.
+ *
+ * The library neither allocates memory nor performs I/O, and keeps no global
+ * state: everything needed to crypt lives in a caller-provided struct
+ * caesar_key, which may be shared between threads once initialized.
+ */
+#ifndef CAESAR_H
+#define CAESAR_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Number of letters in the alphabet */
+#define CAESAR_ALPHABET_SIZE 26
+
+/** Longest keyword caesar_key_init_keyword() accepts */
+#define CAESAR_KEYWORD_MAX 256
+
+/** Shifts repeated after the keyword's period, one vector's worth */
+#define CAESAR_SCHEDULE_SLACK 64
+
+/** Alphabet used by caesar_key_init(): lower and upper case ASCII letters */
+#define CAESAR_DEFAULT_ALPHABET "a-z,A-Z"
+
+/** Kernels a key can crypt with */
+enum caesar_kernel {
+    CAESAR_KERNEL_REFERENCE, /**< Reference, one character at a time */
+    CAESAR_KERNEL_TABLE,     /**< Scalar translation table lookup */
+    CAESAR_KERNEL_SSE2,      /**< 16 bytes at a time with SSE2 */
+    CAESAR_KERNEL_AVX2,      /**< 32 bytes at a time with AVX2 */
+    CAESAR_KERNEL_AVX512,    /**< 64 bytes at a time with AVX-512BW */
+    CAESAR_KERNEL_NEON,      /**< 16 bytes at a time with NEON */
+    CAESAR_KERNEL_VBMI,      /**< 64-byte table lookups with AVX-512VBMI */
+    CAESAR_KERNEL_COUNT,
+};
+
+struct caesar_key;
+
+/** Function implementing a kernel. in and out may be the same buffer. */
+typedef void (*caesar_kernel_fn)(const struct caesar_key *key,
+                                 const uint8_t *in, uint8_t *out, size_t n);
+
+/**
+ * Function implementing a kernel for keyword keys, starting at the given
+ * phase of the schedule. in and out may be the same buffer.
+ */
+typedef void (*caesar_schedule_fn)(const struct caesar_key *key, size_t phase,
+                                   const uint8_t *in, uint8_t *out, size_t n);
+
+/**
+ * A key prepared for crypting: the translation table mapping every byte value
+ * to its crypted value, along with the kernel to crypt with. Keyword keys
+ * instead shift each byte by the keyword letter for its position.
+ */
+struct caesar_key {
+    uint8_t map[UCHAR_MAX + 1];
+    int shift;               /**< Right-shift reduced to [0, 26) */
+    bool letters;            /**< map crypts CAESAR_DEFAULT_ALPHABET by shift */
+    caesar_kernel_fn kernel; /**< Fastest supported kernel, by default */
+    size_t period;           /**< Length of the keyword, or 0 if none */
+    /** Right-shift for each position modulo period, repeated for the slack */
+    uint8_t schedule[CAESAR_KEYWORD_MAX + CAESAR_SCHEDULE_SLACK];
+    caesar_schedule_fn schedule_kernel; /**< Kernel used if period is set */
+};
+
+/** Most non-ASCII code points a struct caesar_utf8_key can rotate */
+#define CAESAR_UTF8_MAX 1024
+
+/**
+ * A key prepared for crypting UTF-8 text. ASCII bytes are crypted through an
+ * ordinary key, which leaves every byte with the high bit set unchanged, and
+ * rotated non-ASCII code points are looked up in a sorted table.
+ */
+struct caesar_utf8_key {
+    struct caesar_key ascii;             /**< Key for the ASCII range */
+    uint32_t map[CAESAR_UTF8_MAX][2];    /**< Code point and its replacement,
+                                              sorted by code point */
+    size_t n;                            /**< Number of entries in map */
+};
+
+/**
+ * @brief Prepare a key for the given shift
+ *
+ * The fastest kernel supported by the running CPU is selected.
+ *
+ * @param key   Key to initialize
+ * @param shift Number of characters to logically right-shift, negative to
+ *              left-shift
+ */
+void caesar_key_init(struct caesar_key *key, long shift);
+
+/**
+ * @brief Prepare a Vigenère key repeating the shifts of a keyword
+ *
+ * Byte i of a stream is shifted by letter i modulo the keyword length, 'a' or
+ * 'A' standing for no shift. Every byte position counts, alphabetic or not, so
+ * any part of a stream can be crypted knowing only its offset.
+ *
+ * @param key       Key to initialize
+ * @param keyword   Letters giving the shift of each position
+ * @param decrypt   Whether to shift left rather than right
+ * @return 0 on success, or -1 with errno set to EINVAL if the keyword is
+ *         empty, longer than CAESAR_KEYWORD_MAX or not only letters
+ */
+int caesar_key_init_keyword(struct caesar_key *key, const char *keyword,
+                            bool decrypt);
+
+/**
+ * @brief Move the start of a key's stream forward
+ *
+ * Afterwards, crypting at offset 0 with the key gives the same result as
+ * crypting at offset n did before. Only keyword keys change.
+ *
+ * @param key   Initialized key
+ * @param n     Number of bytes to move forward by
+ */
+void caesar_key_advance(struct caesar_key *key, uint64_t n);
+
+/**
+ * @brief Prepare a key for the given shift over a custom alphabet
+ *
+ * The alphabet is a comma-separated list of groups, each rotated separately
+ * by the shift like the lower and upper case letters of the default alphabet.
+ * A group lists its characters in order, with X-Y standing for every byte from
+ * X to Y. A backslash escapes ',', '-' or '\\', and \\xHH gives any byte by
+ * its hexadecimal value. A '-' at the start or end of a group is literal.
+ * Bytes in no group are left unchanged.
+ *
+ * Only the table-driven kernels can crypt a custom alphabet, unless it turns
+ * out to crypt the same as CAESAR_DEFAULT_ALPHABET.
+ *
+ * @param key       Key to initialize
+ * @param shift     Number of characters to logically right-shift, negative
+ *                  to left-shift
+ * @param alphabet  Alphabet specification
+ * @return 0 on success, or -1 with errno set to EINVAL if the specification
+ *         is malformed or lists a byte twice
+ */
+int caesar_key_init_alphabet(struct caesar_key *key, long shift,
+                             const char *alphabet);
+
+/**
+ * @brief Get the number of shifts after which an alphabet maps to itself
+ *
+ * This is the least common multiple of the lengths of its groups, 26 for
+ * CAESAR_DEFAULT_ALPHABET, so any two shifts congruent modulo the period
+ * crypt alike, and keys too large for a long can be reduced by it first.
+ *
+ * @param alphabet  Alphabet specification, as for caesar_key_init_alphabet()
+ * @param utf8      Whether unescaped characters are UTF-8 sequences, as for
+ *                  caesar_utf8_key_init()
+ * @return Period of the alphabet, or -1 with errno set to EINVAL if the
+ *         specification is malformed or EOVERFLOW if the period does not fit
+ *         in a long
+ */
+long caesar_alphabet_period(const char *alphabet, bool utf8);
+
+/**
+ * @brief Prepare a UTF-8 key for the given shift over an alphabet
+ *
+ * The alphabet has the same syntax as for caesar_key_init_alphabet(), but
+ * unescaped characters are UTF-8 sequences and \\xHH stands for the code
+ * point U+00HH. Every character of a group must have the same encoded length,
+ * so that crypting never changes the length of the text.
+ *
+ * @param key       Key to initialize
+ * @param shift     Number of characters to logically right-shift, negative
+ *                  to left-shift
+ * @param alphabet  Alphabet specification, e.g. CAESAR_DEFAULT_ALPHABET
+ * @return 0 on success, or -1 with errno set to EINVAL if the specification
+ *         is malformed, lists a character twice, mixes encoded lengths in a
+ *         group or has more than CAESAR_UTF8_MAX non-ASCII characters
+ */
+int caesar_utf8_key_init(struct caesar_utf8_key *key, long shift,
+                         const char *alphabet);
+
+/**
+ * @brief Make a key crypt with a specific kernel
+ * @param key       Initialized key
+ * @param kernel    Kernel to use
+ * @return 0 on success, or -1 if the kernel is not supported on this machine
+ *         or cannot crypt the key's alphabet
+ */
+int caesar_key_set_kernel(struct caesar_key *key, enum caesar_kernel kernel);
+
+/**
+ * @brief Check whether a kernel is supported on this machine
+ * @param kernel    Kernel to check
+ * @return true if the kernel can be used
+ */
+bool caesar_kernel_supported(enum caesar_kernel kernel);
+
+/**
+ * @brief Get the name of a kernel
+ * @param kernel    Kernel to name
+ * @return Short lower case name of the kernel
+ */
+const char *caesar_kernel_name(enum caesar_kernel kernel);
+
+/**
+ * @brief Crypt a buffer into another, not changing non-alphabetic bytes
+ * @param key   Prepared key
+ * @param in    Bytes to crypt
+ * @param out   Buffer of at least n bytes to write the result to. It may be
+ *              the same as in, but must not otherwise overlap it.
+ * @param n     Number of bytes to crypt
+ */
+void caesar_transform(const struct caesar_key *key, const uint8_t *in,
+                      uint8_t *out, size_t n);
+
+/**
+ * @brief Crypt a buffer in place, not changing non-alphabetic bytes
+ * @param key   Prepared key
+ * @param buf   Bytes to crypt
+ * @param n     Number of bytes to crypt
+ */
+void caesar_transform_inplace(const struct caesar_key *key, uint8_t *buf,
+                              size_t n);
+
+/**
+ * @brief Crypt a buffer found at the given offset of a stream
+ *
+ * Only keyword keys depend on the offset. caesar_transform() is the same as
+ * starting at offset 0.
+ *
+ * @param key   Prepared key
+ * @param pos   Offset in the stream of the first byte
+ * @param in    Bytes to crypt
+ * @param out   Buffer of at least n bytes to write the result to, as for
+ *              caesar_transform()
+ * @param n     Number of bytes to crypt
+ */
+void caesar_transform_at(const struct caesar_key *key, uint64_t pos,
+                         const uint8_t *in, uint8_t *out, size_t n);
+
+/**
+ * @brief Crypt a buffer found at the given offset of a stream in place
+ * @param key   Prepared key
+ * @param pos   Offset in the stream of the first byte
+ * @param buf   Bytes to crypt
+ * @param n     Number of bytes to crypt
+ */
+void caesar_transform_inplace_at(const struct caesar_key *key, uint64_t pos,
+                                 uint8_t *buf, size_t n);
+
+/**
+ * @brief Crypt UTF-8 text in place
+ *
+ * Blocks of pure ASCII cost one vector kernel pass and a scan for high bytes.
+ * Malformed sequences are left unchanged, as is a sequence cut off by the end
+ * of the buffer, so buffers should end on a boundary found with
+ * caesar_utf8_boundary().
+ *
+ * @param key   Prepared UTF-8 key
+ * @param buf   Text to crypt
+ * @param n     Number of bytes to crypt
+ */
+void caesar_utf8_transform_inplace(const struct caesar_utf8_key *key,
+                                   uint8_t *buf, size_t n);
+
+/**
+ * @brief Find where the last complete UTF-8 sequence of a buffer ends
+ * @param buf   Text to check
+ * @param n     Number of bytes in buf
+ * @return Length of buf without the truncated sequence it ends with, if any
+ */
+size_t caesar_utf8_boundary(const uint8_t *buf, size_t n);
+
+#endif
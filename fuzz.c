@@ -0,0 +1,120 @@
+/**
+ * @file fuzz.c
+ * libFuzzer target checking every supported kernel against the reference.
+ *
+ * Built with `make fuzz`, which needs clang for -fsanitize=fuzzer. The first
+ * bytes of each input choose a key and a stream offset, and the rest is
+ * crypted by the reference kernel, or the scalar table for a custom alphabet,
+ * and by every other kernel the running CPU supports, in and out of place.
+ * The buffers are exactly the input's length, so that AddressSanitizer
+ * catches a kernel touching bytes past either end.
+ */
+#include "caesar.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Bytes of an input taken up by the choice of key and offset */
+#define FUZZ_HEADER 10
+
+/** Alphabets a custom alphabet key is drawn from */
+static const char *const FUZZ_ALPHABETS[] = {
+    CAESAR_DEFAULT_ALPHABET,
+    "a-z,A-Z,0-9",
+    "a-m,n-z,\\x80-\\xff",
+    "0-9a-f,-",
+};
+
+/**
+ * @brief Prepare the key an input asks for
+ *
+ * Byte 0 chooses a shift, a keyword or an alphabet key, and bytes 1 and 2
+ * give its shift or keyword length. A keyword is spelt by the letters the
+ * payload bytes map to.
+ *
+ * @param key       Key to initialize
+ * @param data      Header of FUZZ_HEADER bytes
+ * @param payload   Bytes following the header
+ * @param n         Number of payload bytes
+ * @return 0 on success, or -1 if the input gives no valid key
+ */
+static int fuzz_key(struct caesar_key *key, const uint8_t *data,
+                    const uint8_t *payload, size_t n)
+{
+    long shift = (int16_t)(data[1] | data[2] << 8);
+    switch (data[0] % 3) {
+    case 0:
+        caesar_key_init(key, shift);
+        return 0;
+    case 1: {
+        char keyword[CAESAR_KEYWORD_MAX + 1];
+        size_t len = 1 + (data[1] | data[2] << 8) % CAESAR_KEYWORD_MAX;
+        for (size_t i = 0; i < len; i++) {
+            keyword[i] = 'a' + (i < n ? payload[i] : i) % 26;
+        }
+        keyword[len] = '\0';
+        return caesar_key_init_keyword(key, keyword, data[0] & 0x80);
+    }
+    default:
+        return caesar_key_init_alphabet(
+            key, shift,
+            FUZZ_ALPHABETS[(data[0] >> 2) % (sizeof(FUZZ_ALPHABETS) /
+                                             sizeof(*FUZZ_ALPHABETS))]);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size < FUZZ_HEADER) {
+        return 0;
+    }
+    const uint8_t *in = data + FUZZ_HEADER;
+    size_t n = size - FUZZ_HEADER;
+
+    struct caesar_key key;
+    if (fuzz_key(&key, data, in, n) < 0) {
+        return 0;
+    }
+    uint64_t pos = 0;
+    for (int i = 3; i < FUZZ_HEADER; i++) {
+        pos = pos << 8 | data[i];
+    }
+
+    uint8_t *expected = malloc(n);
+    uint8_t *out = malloc(n);
+    if ((expected == NULL || out == NULL) && n > 0) {
+        abort();
+    }
+    // Custom alphabets are only crypted by the table-driven kernels
+    struct caesar_key reference = key;
+    if (caesar_key_set_kernel(&reference, CAESAR_KERNEL_REFERENCE) < 0 &&
+        caesar_key_set_kernel(&reference, CAESAR_KERNEL_TABLE) < 0) {
+        abort();
+    }
+    caesar_transform_at(&reference, pos, in, expected, n);
+
+    for (int kernel = 0; kernel < CAESAR_KERNEL_COUNT; kernel++) {
+        struct caesar_key copy = key;
+        if (!caesar_kernel_supported(kernel) ||
+            caesar_key_set_kernel(&copy, kernel) < 0) {
+            continue;
+        }
+        caesar_transform_at(&copy, pos, in, out, n);
+        if (n > 0 && memcmp(out, expected, n) != 0) {
+            abort();
+        }
+        if (n > 0) {
+            memcpy(out, in, n);
+        }
+        caesar_transform_inplace_at(&copy, pos, out, n);
+        if (n > 0 && memcmp(out, expected, n) != 0) {
+            abort();
+        }
+    }
+
+    free(expected);
+    free(out);
+    return 0;
+}
@@ -2,77 +2,334 @@
  * @file main.c
  * Main file for Caesar cipher application.
  */
+#define _GNU_SOURCE
+#include "batch.h"
+#include "bench.h"
+#include "caesar.h"
+#include "numa.h"
+#include "relay.h"
+#include "serve.h"
+#include "stats.h"
+#include "stream.h"
+#include "tune.h"
+#include "verify.h"
+
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-const int ALPHABET_SIZE = 26;
+/** Letters below which crack_stream() keeps sampling regardless of scores */
+#define CRACK_MIN_LETTERS 1024
+
+/** Bytes after which crack_stream() settles on the best key regardless */
+#define CRACK_MAX_SAMPLE (16 * 1024 * 1024)
+
+/** Number of evenly spaced blocks crack_stream() samples from regular files */
+#define CRACK_FILE_SAMPLES 64
+
+/**
+ * @brief Crypt a message in place, not changing non-alphabetic characters
+ *
+ * The message is crypted with the same kernel as streamed input and written
+ * with a single fwrite(), so no intermediate buffer is needed.
+ * @param key   Prepared key
+ * @param msg   Message to crypt, overwritten with the result
+ * @param len   Length of the message in bytes
+ * @param out   Output stream to write to
+ * @return 0 on success, -1 on error with errno set
+ */
+static int crypt_str(const struct caesar_key *key, char *msg, size_t len,
+                     FILE *out)
+{
+    caesar_transform_inplace(key, (uint8_t *)msg, len);
+    return fwrite(msg, 1, len, out) == len ? 0 : -1;
+}
+
+/** Outputs of a multi-key run, one per key */
+struct multi_out {
+    const struct caesar_key *ciphers;
+    const char *const *names; /**< Keys as given by the user, to tag output */
+    size_t nkeys;
+    const int *fds; /**< One descriptor per key, or NULL for a tagged stream */
+    int tag_fd;     /**< Descriptor of the tagged stream if fds is NULL */
+};
 
 /**
- * @brief Crypt a single character with the given shift and alphabet base
- * @param shift Number of characters to logically right-shift
- * @param base  Base character of alphabet, i.e. 'a' or 'A'
- * @param c     Character to shift
- * @return Shifted character
+ * @brief Crypt one block with every key of a multi-key run
+ *
+ * The block is crypted into a scratch buffer once per key, so the input stays
+ * cache resident for all keys. Without per-key outputs,
+ * each result is written to the tagged stream as a record consisting of a
+ * "key length" header line, the crypted bytes and a newline.
+ *
+ * @param out       Outputs of the run
+ * @param block     Block to crypt, left unchanged
+ * @param scratch   Scratch buffer at least len bytes long
+ * @param len       Number of bytes in the block
+ * @return 0 on success, or -1 on failure with errno set
  */
-static char crypt_char_base(int shift, char base, char c)
+static int crypt_block_multi(const struct multi_out *out, const char *block,
+                             char *scratch, size_t len)
 {
-    // Convert a negative offset so it works properly with %
-    shift = ((shift % ALPHABET_SIZE) + ALPHABET_SIZE) % ALPHABET_SIZE;
+    for (size_t k = 0; k < out->nkeys; k++) {
+        caesar_transform(&out->ciphers[k], (const uint8_t *)block,
+                         (uint8_t *)scratch, len);
 
-    int cur_offset = c - base;
-    int tgt_offset = (cur_offset + shift) % ALPHABET_SIZE;
-    return base + tgt_offset;
+        if (out->fds != NULL) {
+            if (write_all(out->fds[k], scratch, len) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        // Keys may be any number of digits long, so are written on their own
+        char header[32];
+        int header_len = snprintf(header, sizeof(header), " %zu\n", len);
+        if (write_all(out->tag_fd, out->names[k], strlen(out->names[k])) < 0 ||
+            write_all(out->tag_fd, header, header_len) < 0 ||
+            write_all(out->tag_fd, scratch, len) < 0 ||
+            write_all(out->tag_fd, "\n", 1) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
 /**
- * @brief Crypt a single ASCII character
- * @param shift Number of characters to logically right-shift
- * @param c     Character to shift
- * @return Crypted character, or the same character if not alphabetic
+ * @brief Crypt a stream with several keys in a single pass over the input
+ * @param out           Outputs of the run
+ * @param in_fd         File descriptor to read from
+ * @param block_size    Size in bytes of the block buffer
+ * @return 0 on success, or -1 on failure with errno set
  */
-static char crypt_char(int shift, char c)
+static int crypt_stream_multi(const struct multi_out *out, int in_fd,
+                              size_t block_size)
 {
-    if (c >= 'A' && c <= 'Z') {
-        return crypt_char_base(shift, 'A', c);
+    char *block = malloc(block_size);
+    char *scratch = malloc(block_size);
+    int ret = -1;
+    if (block == NULL || scratch == NULL) {
+        goto out_free;
     }
-    if (c >= 'a' && c <= 'z') {
-        return crypt_char_base(shift, 'a', c);
+
+    for (;;) {
+        ssize_t len = read(in_fd, block, block_size);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto out_free;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (crypt_block_multi(out, block, scratch, len) < 0) {
+            goto out_free;
+        }
     }
+    ret = 0;
 
-    return c;
+out_free:;
+    int saved_errno = errno;
+    free(block);
+    free(scratch);
+    errno = saved_errno;
+    return ret;
 }
 
+/** Relative frequencies in percent of the letters 'a' to 'z' in English */
+static const double ENGLISH_FREQ[] = {
+    8.167, 1.492, 2.782, 4.253, 12.702, 2.228, 2.015, 6.094, 6.966,
+    0.153, 0.772, 4.025, 2.406, 6.749,  7.507, 1.929, 0.095, 5.987,
+    6.327, 9.056, 2.758, 0.978, 2.360,  0.150, 1.974, 0.074,
+};
+
+/** Byte histogram of the input sampled by the crack mode */
+struct byte_hist {
+    unsigned long long count[UCHAR_MAX + 1];
+};
+
 /**
- * @brief Crypt an ASCII string, not changing non-alphabetic characters
- * @param shift Number of characters to logically right-shift
- * @param in    String to crypt
- * @param out   Output stream to write to
+ * @brief Add the bytes of a buffer to a histogram
+ *
+ * Four partial histograms are counted in an interleaved fashion, so that
+ * runs of the same byte do not serialize on a single counter.
+ *
+ * @param hist  Histogram to add to
+ * @param buf   Buffer to count
+ * @param len   Number of bytes in the buffer
  */
-static void crypt_str(int shift, const char *in, FILE *out)
+static void byte_hist_add(struct byte_hist *hist, const char *buf, size_t len)
 {
-    int len = strlen(in);
-    for (int i = 0; i < len; i++) {
-        fputc(crypt_char(shift, in[i]), out);
+    unsigned part[4][UCHAR_MAX + 1] = {{0}};
+    const unsigned char *p = (const unsigned char *)buf;
+
+    // Flush the partial counts before they can overflow
+    while (len > 0) {
+        size_t n = len < (UINT_MAX / 4) ? len : (UINT_MAX / 4);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            part[0][p[i]]++;
+            part[1][p[i + 1]]++;
+            part[2][p[i + 2]]++;
+            part[3][p[i + 3]]++;
+        }
+        for (; i < n; i++) {
+            part[0][p[i]]++;
+        }
+
+        for (int c = 0; c <= UCHAR_MAX; c++) {
+            hist->count[c] += part[0][c] + part[1][c] + part[2][c] + part[3][c];
+            part[0][c] = part[1][c] = part[2][c] = part[3][c] = 0;
+        }
+        p += n;
+        len -= n;
     }
 }
 
 /**
- * @brief Crypt an ASCII string stream, not changing non-alphabetic characters
- * @param shift Number of characters to logically right-shift
- * @param in    Input stream to read from
- * @param out   Output stream to write to
+ * @brief Score every key against English letter frequencies
+ *
+ * Each key is scored with the chi-squared statistic of the letter counts after
+ * decrypting with that key, so lower scores are better.
+ *
+ * @param hist      Histogram of the ciphertext
+ * @param best      Set to the best (lowest scoring) key
+ * @param confident Set to whether the best key clearly beats the runner-up
+ *                  on enough letters to stop sampling
  */
-static void crypt_stream(int shift, FILE *in, FILE *out)
+static void crack_score(const struct byte_hist *hist, int *best,
+                        bool *confident)
 {
-    int in_char;
-    while ((in_char = fgetc(in)) != EOF) {
-        fputc(crypt_char(shift, in_char), out);
+    unsigned long long letters[CAESAR_ALPHABET_SIZE];
+    unsigned long long total = 0;
+    for (int i = 0; i < CAESAR_ALPHABET_SIZE; i++) {
+        letters[i] = hist->count['a' + i] + hist->count['A' + i];
+        total += letters[i];
+    }
+
+    double best_score = -1;
+    double second_score = -1;
+    *best = 0;
+    for (int key = 0; key < CAESAR_ALPHABET_SIZE; key++) {
+        double score = 0;
+        for (int i = 0; i < CAESAR_ALPHABET_SIZE; i++) {
+            double expected = total * ENGLISH_FREQ[i] / 100;
+            double diff = letters[(i + key) % CAESAR_ALPHABET_SIZE] - expected;
+            score += diff * diff / expected;
+        }
+        if (best_score < 0 || score < best_score) {
+            second_score = best_score;
+            best_score = score;
+            *best = key;
+        } else if (second_score < 0 || score < second_score) {
+            second_score = score;
+        }
     }
+
+    // A factor of two between the best and the runner-up is far outside what
+    // sampling noise produces once there are this many letters
+    *confident = total >= CRACK_MIN_LETTERS && second_score > 2 * best_score;
+}
+
+/**
+ * @brief Recover the key of a ciphertext stream and decrypt it
+ *
+ * Regular files are sampled with pread(2) at evenly spaced offsets before the
+ * whole file is decrypted from the start. Other inputs are buffered only
+ * until the scores are confident, so little more than the sample is held in
+ * memory, and the rest of the stream is decrypted as it is read.
+ *
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param block_size    Size in bytes of each block
+ * @param jobs          Number of worker threads
+ * @param use_splice    Whether to vmsplice into the output pipe
+ * @param key           Set to the recovered key
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int crack_stream(int in_fd, int out_fd, size_t block_size, size_t jobs,
+                        bool use_splice, int *key)
+{
+    struct byte_hist hist = {{0}};
+    bool confident = false;
+    struct caesar_key cipher;
+
+    struct stat st;
+    off_t start = lseek(in_fd, 0, SEEK_CUR);
+    if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode) && start >= 0) {
+        char *buf = malloc(block_size);
+        if (buf == NULL) {
+            return -1;
+        }
+
+        off_t span = st.st_size - start;
+        off_t stride = span / CRACK_FILE_SAMPLES;
+        stride = stride < (off_t)block_size ? (off_t)block_size : stride;
+        for (off_t off = start; off < st.st_size && !confident; off += stride) {
+            ssize_t len = pread(in_fd, buf, block_size, off);
+            if (len < 0) {
+                int saved_errno = errno;
+                free(buf);
+                errno = saved_errno;
+                return -1;
+            }
+            byte_hist_add(&hist, buf, len);
+            crack_score(&hist, key, &confident);
+        }
+        free(buf);
+
+        crack_score(&hist, key, &confident);
+        caesar_key_init(&cipher, -*key);
+        return crypt_stream_with(&cipher, in_fd, out_fd, block_size, jobs,
+                                 use_splice);
+    }
+
+    char *sample = NULL;
+    size_t len = 0;
+    bool eof = false;
+    while (!confident && !eof && len < CRACK_MAX_SAMPLE) {
+        char *grown = realloc(sample, len + block_size);
+        if (grown == NULL) {
+            free(sample);
+            return -1;
+        }
+        sample = grown;
+
+        ssize_t got = read_full(in_fd, sample + len, block_size);
+        if (got < 0) {
+            int saved_errno = errno;
+            free(sample);
+            errno = saved_errno;
+            return -1;
+        }
+        eof = (size_t)got < block_size;
+        byte_hist_add(&hist, sample + len, got);
+        len += got;
+        crack_score(&hist, key, &confident);
+    }
+
+    caesar_key_init(&cipher, -*key);
+    caesar_transform_inplace(&cipher, (uint8_t *)sample, len);
+    int ret = write_all(out_fd, sample, len);
+    int saved_errno = errno;
+    free(sample);
+    errno = saved_errno;
+    if (ret < 0 || eof) {
+        return ret;
+    }
+
+    return crypt_stream_with(&cipher, in_fd, out_fd, block_size, jobs,
+                             use_splice);
 }
 
 /**
@@ -81,7 +338,26 @@ static void crypt_stream(int shift, FILE *in, FILE *out)
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "usage: %s [-h] (-d key | -e key) [msg]\n", prog);
+    fprintf(stderr,
+            "usage: %s [-h] [-b size] [-j jobs] [--auto[=cache]]\n"
+            "       %*s [-i file [--in-place]] [-o file] [--splice] [--stats]\n"
+            "       %*s [--alphabet spec] [--utf8] [--batch source]\n"
+            "       %*s [--gzip | --zstd] [--offset n] [--length n]\n"
+            "       %*s [--line-buffered] [--flush-us us]\n"
+            "       %*s (-d keys | -e keys | -k word | -K word | --all-keys |\n"
+            "       %*s  --crack) [msg]\n"
+            "       %s --bench[=size]\n"
+            "       %s --bench-startup [program...]\n"
+            "       %s --bench-compare[=size] baseline program...\n"
+            "       %s --verify[=seed]\n"
+            "       %s --numa [-j jobs]\n"
+            "       %s (-d key | -e key) --serve socket\n"
+            "       %s [-j jobs] (-d key | -e key | -k word | -K word)\n"
+            "       %*s --listen [host:]port --forward host:port\n",
+            prog, (int)strlen(prog), "", (int)strlen(prog), "",
+            (int)strlen(prog), "", (int)strlen(prog), "", (int)strlen(prog),
+            "", (int)strlen(prog), "", prog, prog, prog, prog, prog, prog, prog,
+            (int)strlen(prog), "");
     fprintf(stderr, "\n");
     fprintf(
         stderr,
@@ -93,10 +369,115 @@ static void usage(char *prog)
         "encrypted or decrypted message is written to standard output.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "-h   Display program usage\n");
-    fprintf(stderr, "-d   Decrypt message using the given key\n");
-    fprintf(stderr, "-e   Encrypt message using the given key\n");
+    fprintf(stderr, "-d   Decrypt message using the given key, or comma-"
+                    "separated keys\n");
+    fprintf(stderr, "-e   Encrypt message using the given key, or comma-"
+                    "separated keys\n");
+    fprintf(stderr, "-k   Encrypt message with the Vigenere cipher, shifting "
+                    "each\n"
+                    "     byte by the next letter of the given keyword\n");
+    fprintf(stderr, "-K   Decrypt message with the Vigenere cipher and the "
+                    "given\n"
+                    "     keyword\n");
+    fprintf(stderr, "-b   Block size in bytes used when streaming input\n");
+    fprintf(stderr, "-j   Number of worker threads used when streaming "
+                    "input\n");
+    fprintf(stderr, "-i   Read the message from the given file instead of "
+                    "stdin\n");
+    fprintf(stderr, "-o   Write the result to the given file instead of "
+                    "stdout\n");
+    fprintf(stderr, "--in-place\n"
+                    "     Crypt the file given with -i in place\n");
+    fprintf(stderr, "--alphabet spec\n"
+                    "     Rotate the comma-separated groups of characters in "
+                    "spec\n"
+                    "     instead of the letters, e.g. a-z,A-Z,0-9. X-Y is a "
+                    "range\n"
+                    "     and \\xHH any byte\n");
+    fprintf(stderr, "--utf8\n"
+                    "     Treat the input and alphabet as UTF-8, so non-ASCII "
+                    "characters\n"
+                    "     can be rotated and are never split\n");
+    fprintf(stderr, "--all-keys\n"
+                    "     Encrypt message using every key from 0 to 25\n");
+    fprintf(stderr, "--crack\n"
+                    "     Recover the key from English letter frequencies and "
+                    "decrypt\n");
+    fprintf(stderr, "--bench[=size]\n"
+                    "     Benchmark every kernel on synthetic inputs of up to "
+                    "the given\n"
+                    "     size in bytes (K, M or G suffix allowed, default "
+                    "32M)\n");
+    fprintf(stderr, "--bench-startup [program...]\n"
+                    "     Time each program, or this one, crypting a short "
+                    "message\n"
+                    "     given on the command line\n");
+    fprintf(stderr, "--bench-compare[=size] baseline program...\n"
+                    "     Run --bench with each program and show how much "
+                    "faster or\n"
+                    "     slower it is than the baseline\n");
+    fprintf(stderr, "--verify[=seed]\n"
+                    "     Check every kernel and stream engine against a "
+                    "model of the\n"
+                    "     cipher on random inputs, drawn from the given "
+                    "seed\n");
+    fprintf(stderr, "--numa\n"
+                    "     Show the NUMA nodes and where each of the -j "
+                    "workers is placed\n");
+    fprintf(stderr, "--serve socket\n"
+                    "     Serve length-prefixed crypt requests on the given "
+                    "Unix socket\n");
+    fprintf(stderr, "--listen [host:]port\n"
+                    "     Relay TCP connections accepted on the given address "
+                    "to the\n"
+                    "     --forward address, crypting what clients send with "
+                    "the key\n"
+                    "     and what comes back with its inverse\n");
+    fprintf(stderr, "--forward host:port\n"
+                    "     Address --listen relays connections to\n");
+    fprintf(stderr, "--offset n\n"
+                    "     Start n bytes into a seekable input (K, M or G "
+                    "suffix allowed)\n");
+    fprintf(stderr, "--length n\n"
+                    "     Crypt at most n bytes of a seekable input\n");
+    fprintf(stderr, "--line-buffered\n"
+                    "     Write each line of output as soon as its input "
+                    "line ends\n");
+    fprintf(stderr, "--flush-us us\n"
+                    "     Like --line-buffered, also writing an unfinished "
+                    "line after us\n"
+                    "     microseconds\n");
+    fprintf(stderr, "--gzip, --zstd\n"
+                    "     Decompress the input and compress the output, as "
+                    "gzip or\n"
+                    "     Zstandard\n");
+    fprintf(stderr, "--batch source\n"
+                    "     Crypt in place every file below the directory "
+                    "source, or\n"
+                    "     listed one per line in the file source, '-' for "
+                    "stdin\n");
+    fprintf(stderr, "--auto[=cache]\n"
+                    "     Pick the block size and number of threads by timing "
+                    "the start\n"
+                    "     of the input, remembering them in the cache file if "
+                    "given\n");
+    fprintf(stderr, "--stats\n"
+                    "     Report bytes, time spent reading, crypting and "
+                    "writing, and\n"
+                    "     hardware counters on stderr at exit\n");
+    fprintf(stderr, "--splice\n"
+                    "     Hand output to a pipe by reference when both stdin "
+                    "and stdout\n"
+                    "     are pipes\n");
     fprintf(stderr, "msg  ASCII text to encrypt or decrypt. If omitted, read "
                     "from stdin.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr,
+            "With several keys, the input is read once and crypted with every\n"
+            "key. With -o, the result for each key is written to the file\n"
+            "named by -o followed by '.' and the key. Otherwise each result\n"
+            "is written to standard output as a \"key length\" line, the\n"
+            "crypted message and a newline.\n");
     exit(1);
 }
 
@@ -125,39 +506,535 @@ static long parse_positive_long(const char *arg)
     return arg_long;
 }
 
+/**
+ * @brief Parse a positive size with an optional K, M or G binary suffix
+ * @param arg   String to parse
+ * @return The size in bytes, or negative on failure
+ */
+static long parse_size(const char *arg)
+{
+    char *endptr = NULL;
+    errno = 0;
+    long size = strtol(arg, &endptr, 10);
+    if (endptr == arg || size < 0 || errno == ERANGE) {
+        return -1;
+    }
+
+    int shift = 0;
+    switch (*endptr) {
+    case 'G':
+        shift += 10;
+        // fallthrough
+    case 'M':
+        shift += 10;
+        // fallthrough
+    case 'K':
+        shift += 10;
+        endptr++;
+        break;
+    }
+    if (*endptr != '\0' || size > (LONG_MAX >> shift)) {
+        return -1;
+    }
+
+    return size << shift;
+}
+
+/** Largest alphabet period parse_key() can reduce by without overflowing */
+#define KEY_PERIOD_MAX ((LONG_MAX - 9) / 10)
+
+/**
+ * @brief Parse a key of any number of decimal digits
+ *
+ * The key is reduced digit by digit modulo the period of the alphabet, so it
+ * never has to fit in a long and no kernel sees more than the reduced shift.
+ *
+ * @param arg       String to parse
+ * @param period    Period of the alphabet, as from caesar_alphabet_period(),
+ *                  or 0 to take the key as it is if it fits in a long
+ * @return The key modulo period, or negative on failure
+ */
+static long parse_key(const char *arg, long period)
+{
+    if (period <= 0 || period > KEY_PERIOD_MAX) {
+        return parse_positive_long(arg);
+    }
+
+    long key = 0;
+    for (const char *p = arg; *p != '\0'; p++) {
+        if (*p < '0' || *p > '9') {
+            return -1;
+        }
+        key = (key * 10 + (*p - '0')) % period;
+    }
+    return *arg != '\0' ? key : -1;
+}
+
+/**
+ * @brief Parse a comma-separated list of keys
+ * @param arg       String to parse
+ * @param period    Period of the alphabet the keys are reduced by, as for
+ *                  parse_key()
+ * @param keys      Set to a newly allocated array of the keys on success
+ * @param names     Set to a newly allocated array of the keys as given, which
+ *                  all point into a single copy of arg at names[0]
+ * @return Number of keys parsed, or negative on failure
+ */
+static long parse_key_list(const char *arg, long period, long **keys,
+                           char ***names)
+{
+    size_t nkeys = 1;
+    for (const char *p = arg; *p != '\0'; p++) {
+        nkeys += (*p == ',');
+    }
+
+    char *copy = strdup(arg);
+    *keys = calloc(nkeys, sizeof(**keys));
+    *names = calloc(nkeys, sizeof(**names));
+    if (copy == NULL || *keys == NULL || *names == NULL) {
+        free(copy);
+        free(*keys);
+        free(*names);
+        return -1;
+    }
+
+    // strsep() rather than strtok() so that empty entries are not skipped
+    char *rest = copy;
+    for (size_t i = 0; i < nkeys; i++) {
+        char *entry = strsep(&rest, ",");
+        (*names)[i] = entry;
+        (*keys)[i] = parse_key(entry, period);
+        if ((*keys)[i] < 0) {
+            free(copy);
+            free(*keys);
+            free(*names);
+            return -1;
+        }
+    }
+
+    return nkeys;
+}
+
+/**
+ * @brief Crypt a message given as `-e key msg` or `-d key msg` without stdio
+ *
+ * Most invocations crypt a short message given on the command line, where
+ * starting up costs more than crypting. This form is recognized before
+ * getopt_long() runs and written with write(), so stdio is only touched to
+ * report errors.
+ * @param argc  Number of arguments
+ * @param argv  Arguments, whose message is crypted in place
+ * @return Exit status, or -1 if the arguments are not of this form
+ */
+static int crypt_argv(int argc, char *argv[])
+{
+    // Anything else, including options after the key, goes to getopt_long()
+    if (argc != 4 || argv[3][0] == '-' ||
+        (strcmp(argv[1], "-e") != 0 && strcmp(argv[1], "-d") != 0)) {
+        return -1;
+    }
+    long key = parse_key(argv[2], CAESAR_ALPHABET_SIZE);
+    if (key < 0) {
+        return -1; // Reported by the full parser
+    }
+
+    struct caesar_key cipher;
+    caesar_key_init(&cipher, argv[1][1] == 'e' ? key : -key);
+    size_t len = strlen(argv[3]);
+    caesar_transform_inplace(&cipher, (uint8_t *)argv[3], len);
+
+    // Add a newline if the output is a terminal, for readability
+    if (write_all(STDOUT_FILENO, argv[3], len) < 0 ||
+        (isatty(STDOUT_FILENO) && write_all(STDOUT_FILENO, "\n", 1) < 0)) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Crypt a message or stream with several keys and write the results
+ * @param prog          Name of program, for error messages
+ * @param ciphers       Prepared key for each key
+ * @param names         Keys as given by the user
+ * @param nkeys         Number of keys
+ * @param message       Message to crypt, or NULL to read from in_fd
+ * @param message_len   Length of message in bytes
+ * @param in_fd         File descriptor to read from if message is NULL
+ * @param out_prefix    Prefix of the per-key output files, or NULL to write
+ *                      a tagged stream to stdout
+ * @param block_size    Size in bytes of the block buffer
+ * @return Exit status for main()
+ */
+static int crypt_multi(const char *prog, const struct caesar_key *ciphers,
+                       char *const *names, size_t nkeys, const char *message,
+                       size_t message_len, int in_fd, const char *out_prefix,
+                       size_t block_size)
+{
+    int status = 1;
+    int *fds = NULL;
+    size_t nopen = 0;
+    if (out_prefix != NULL) {
+        fds = calloc(nkeys, sizeof(*fds));
+        if (fds == NULL) {
+            fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+            return 1;
+        }
+        for (; nopen < nkeys; nopen++) {
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s.%s", out_prefix,
+                         names[nopen]) >= (int)sizeof(path)) {
+                fprintf(stderr, "%s: %s.%s: %s\n", prog, out_prefix,
+                        names[nopen], strerror(ENAMETOOLONG));
+                goto out_close;
+            }
+            fds[nopen] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fds[nopen] < 0) {
+                fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+                goto out_close;
+            }
+        }
+    }
+
+    struct multi_out out = {
+        .ciphers = ciphers,
+        .names = (const char *const *)names,
+        .nkeys = nkeys,
+        .fds = fds,
+        .tag_fd = STDOUT_FILENO,
+    };
+
+    int ret;
+    if (message != NULL) {
+        char *scratch = malloc(message_len);
+        ret = scratch == NULL
+                  ? -1
+                  : crypt_block_multi(&out, message, scratch, message_len);
+        free(scratch);
+    } else {
+        ret = crypt_stream_multi(&out, in_fd, block_size);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+        goto out_close;
+    }
+    status = 0;
+
+out_close:
+    for (size_t k = 0; k < nopen; k++) {
+        if (close(fds[k]) < 0 && status == 0) {
+            fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+            status = 1;
+        }
+    }
+    free(fds);
+    return status;
+}
+
 int main(int argc, char *argv[])
 {
+    int status = crypt_argv(argc, argv);
+    if (status >= 0) {
+        return status;
+    }
+
     /** Parse arguments **/
 
     enum crypt_mode {
         cm_unset,
         cm_encrypt,
         cm_decrypt,
+        cm_crack,
+        cm_bench,
+        cm_bench_startup,
+        cm_bench_compare,
+        cm_verify,
+        cm_numa,
     };
     enum crypt_mode mode = cm_unset;
 
-    long shift = 0;
+    const char *key_list = NULL; // Keys of -d, -e or --all-keys, unparsed
+    bool all_keys = false;
+    long *keys = NULL;
+    char **key_names = NULL;
+    long nkeys = 0;
+    long bench_max = DEFAULT_BENCH_MAX;
+    uint64_t verify_seed = time(NULL); // Different inputs on every run
+    long block_size = DEFAULT_BLOCK_SIZE;
+    long jobs = 1;
+    const char *in_path = NULL;
+    const char *out_path = NULL;
+    bool in_place = false;
+    bool use_splice = false;
+    const char *serve_path = NULL;
+    const char *listen_addr = NULL;
+    const char *forward_addr = NULL;
+    const char *alphabet = NULL;
+    const char *keyword = NULL;
+    bool utf8 = false;
+    bool want_stats = false;
+    bool auto_tune = false;
+    const char *tune_cache = NULL;
+    bool hand_tuned = false; // Whether -b or -j was given
+    bool jobs_given = false;
+    const char *batch_source = NULL;
+    bool compressed = false;
+    bool ranged = false; // Whether --offset or --length was given
+    long range_offset = 0;
+    long range_length = -1; // Up to the end of the file
+    bool line_buffered = false; // Also set by --flush-us
+    long flush_us = 0;
+    enum stream_format format = sf_gzip;
+
+    // Values returned by getopt_long() for options without a short form
+    enum long_opt {
+        lo_in_place = UCHAR_MAX + 1,
+        lo_splice,
+        lo_all_keys,
+        lo_crack,
+        lo_bench,
+        lo_bench_startup,
+        lo_bench_compare,
+        lo_verify,
+        lo_serve,
+        lo_alphabet,
+        lo_utf8,
+        lo_stats,
+        lo_auto,
+        lo_batch,
+        lo_gzip,
+        lo_zstd,
+        lo_numa,
+        lo_offset,
+        lo_length,
+        lo_line_buffered,
+        lo_flush_us,
+        lo_listen,
+        lo_forward,
+    };
+    static const struct option long_opts[] = {
+        {"in-place", no_argument, NULL, lo_in_place},
+        {"splice", no_argument, NULL, lo_splice},
+        {"all-keys", no_argument, NULL, lo_all_keys},
+        {"crack", no_argument, NULL, lo_crack},
+        {"bench", optional_argument, NULL, lo_bench},
+        {"bench-startup", no_argument, NULL, lo_bench_startup},
+        {"bench-compare", optional_argument, NULL, lo_bench_compare},
+        {"verify", optional_argument, NULL, lo_verify},
+        {"serve", required_argument, NULL, lo_serve},
+        {"alphabet", required_argument, NULL, lo_alphabet},
+        {"utf8", no_argument, NULL, lo_utf8},
+        {"stats", no_argument, NULL, lo_stats},
+        {"auto", optional_argument, NULL, lo_auto},
+        {"batch", required_argument, NULL, lo_batch},
+        {"gzip", no_argument, NULL, lo_gzip},
+        {"zstd", no_argument, NULL, lo_zstd},
+        {"numa", no_argument, NULL, lo_numa},
+        {"offset", required_argument, NULL, lo_offset},
+        {"length", required_argument, NULL, lo_length},
+        {"line-buffered", no_argument, NULL, lo_line_buffered},
+        {"flush-us", required_argument, NULL, lo_flush_us},
+        {"listen", required_argument, NULL, lo_listen},
+        {"forward", required_argument, NULL, lo_forward},
+        {NULL, 0, NULL, 0},
+    };
 
     int c;
-    while ((c = getopt(argc, argv, "d:e:h")) != -1) {
+    while ((c = getopt_long(argc, argv, "b:d:e:hi:j:k:K:o:", long_opts,
+                            NULL)) != -1) {
         switch (c) {
+        case 'b':
+            block_size = parse_positive_long(optarg);
+            if (block_size <= 0) {
+                fprintf(stderr, "%s: block size must be a positive base 10 "
+                                "integer\n",
+                        argv[0]);
+                usage(argv[0]); // exits
+            }
+            hand_tuned = true;
+            break;
         case 'd':
             if (mode != cm_unset) {
-                fprintf(stderr, "%s: only -d or -e may be specified\n",
+                fprintf(stderr, "%s: only one of -d, -e, -k, -K, --all-keys "
+                                "or --crack may be specified\n",
                         argv[0]);
                 usage(argv[0]); // exits
             }
             mode = cm_decrypt;
-            shift = parse_positive_long(optarg);
+            key_list = optarg;
             break;
         case 'e':
             if (mode != cm_unset) {
-                fprintf(stderr, "%s: only -d or -e may be specified\n",
+                fprintf(stderr, "%s: only one of -d, -e, -k, -K, --all-keys "
+                                "or --crack may be specified\n",
                         argv[0]);
                 usage(argv[0]); // exits
             }
             mode = cm_encrypt;
-            shift = parse_positive_long(optarg);
+            key_list = optarg;
+            break;
+        case 'k':
+        case 'K':
+            if (mode != cm_unset) {
+                fprintf(stderr, "%s: only one of -d, -e, -k, -K, --all-keys "
+                                "or --crack may be specified\n",
+                        argv[0]);
+                usage(argv[0]); // exits
+            }
+            mode = c == 'k' ? cm_encrypt : cm_decrypt;
+            keyword = optarg;
+            nkeys = 1;
+            keys = calloc(nkeys, sizeof(*keys));
+            if (keys == NULL) {
+                fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+                return 1;
+            }
+            break;
+        case 'i':
+            in_path = optarg;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case lo_in_place:
+            in_place = true;
+            break;
+        case lo_splice:
+            use_splice = true;
+            break;
+        case lo_serve:
+            serve_path = optarg;
+            break;
+        case lo_listen:
+            listen_addr = optarg;
+            break;
+        case lo_forward:
+            forward_addr = optarg;
+            break;
+        case lo_alphabet:
+            alphabet = optarg;
+            break;
+        case lo_utf8:
+            utf8 = true;
+            break;
+        case lo_stats:
+            want_stats = true;
+            break;
+        case lo_auto:
+            auto_tune = true;
+            tune_cache = optarg;
+            break;
+        case lo_all_keys:
+            if (mode != cm_unset) {
+                fprintf(stderr, "%s: only one of -d, -e, -k, -K, --all-keys "
+                                "or --crack may be specified\n",
+                        argv[0]);
+                usage(argv[0]); // exits
+            }
+            mode = cm_encrypt;
+            all_keys = true;
+            // Every key from 0 to CAESAR_ALPHABET_SIZE - 1
+            key_list = "0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,"
+                       "21,22,23,24,25";
+            break;
+        case lo_crack:
+            if (mode != cm_unset) {
+                fprintf(stderr, "%s: only one of -d, -e, -k, -K, --all-keys "
+                                "or --crack may be specified\n",
+                        argv[0]);
+                usage(argv[0]); // exits
+            }
+            mode = cm_crack;
+            break;
+        case lo_bench:
+        case lo_bench_compare:
+            mode = c == lo_bench ? cm_bench : cm_bench_compare;
+            if (optarg != NULL) {
+                bench_max = parse_size(optarg);
+                if (bench_max < 1024) {
+                    fprintf(stderr, "%s: benchmark size must be at least "
+                                    "1K\n",
+                            argv[0]);
+                    usage(argv[0]); // exits
+                }
+            }
+            break;
+        case lo_bench_startup:
+            mode = cm_bench_startup;
+            break;
+        case lo_verify:
+            mode = cm_verify;
+            if (optarg != NULL) {
+                char *endptr;
+                errno = 0;
+                verify_seed = strtoull(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || errno == ERANGE) {
+                    fprintf(stderr, "%s: seed must be a positive base 10 "
+                                    "integer\n",
+                            argv[0]);
+                    usage(argv[0]); // exits
+                }
+            }
+            break;
+        case lo_numa:
+            mode = cm_numa;
+            break;
+        case lo_offset:
+        case lo_length: {
+            long value = parse_size(optarg);
+            if (value < 0) {
+                fprintf(stderr, "%s: %s must be a positive base 10 integer "
+                                "with an optional K, M or G suffix\n",
+                        argv[0], c == lo_offset ? "offset" : "length");
+                usage(argv[0]); // exits
+            }
+            *(c == lo_offset ? &range_offset : &range_length) = value;
+            ranged = true;
+            break;
+        }
+        case lo_line_buffered:
+            line_buffered = true;
+            break;
+        case lo_flush_us:
+            flush_us = parse_positive_long(optarg);
+            if (flush_us <= 0) {
+                fprintf(stderr, "%s: flush time must be a positive base 10 "
+                                "integer\n",
+                        argv[0]);
+                usage(argv[0]); // exits
+            }
+            line_buffered = true;
+            break;
+        case 'j':
+            jobs = parse_positive_long(optarg);
+            if (jobs <= 0) {
+                fprintf(stderr, "%s: jobs must be a positive base 10 integer\n",
+                        argv[0]);
+                usage(argv[0]); // exits
+            }
+            hand_tuned = true;
+            jobs_given = true;
+            break;
+        case lo_batch:
+            batch_source = optarg;
+            break;
+        case lo_gzip:
+        case lo_zstd:
+            if (compressed) {
+                fprintf(stderr, "%s: only one of --gzip or --zstd may be "
+                                "specified\n",
+                        argv[0]);
+                usage(argv[0]); // exits
+            }
+            compressed = true;
+            format = c == lo_gzip ? sf_gzip : sf_zstd;
+            if (!stream_format_supported(format)) {
+                fprintf(stderr, "%s: %s support was not built in, rebuild "
+                                "with make %s=1\n",
+                        argv[0], c == lo_gzip ? "--gzip" : "--zstd",
+                        c == lo_gzip ? "ZLIB" : "ZSTD");
+                return 1;
+            }
             break;
         case 'h':
         default:
@@ -165,34 +1042,418 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (mode == cm_bench) {
+        if (bench(bench_max) < 0) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (mode == cm_verify) {
+        int ret = verify(verify_seed);
+        if (ret < 0) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        }
+        return ret != 0;
+    }
+
+    if (mode == cm_numa) {
+        // Without -j, show how every CPU would be used
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (numa_report(jobs_given ? jobs : ncpus > 0 ? ncpus : 1) < 0) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (mode == cm_bench_startup) {
+        // Without programs to compare, time this one
+        char **progs = optind < argc ? &argv[optind] : &argv[0];
+        size_t nprogs = optind < argc ? (size_t)(argc - optind) : 1;
+        if (bench_startup(progs, nprogs) < 0) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (mode == cm_bench_compare) {
+        if (argc - optind < 2) {
+            fprintf(stderr, "%s: --bench-compare needs a baseline and at "
+                            "least one program\n",
+                    argv[0]);
+            usage(argv[0]); // exits
+        }
+        if (bench_compare(&argv[optind], argc - optind, bench_max) < 0) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
     if (mode == cm_unset) {
-        fprintf(stderr, "%s: either -d or -e are required\n", argv[0]);
+        fprintf(stderr,
+                "%s: one of -d, -e, -k, -K, --all-keys or --crack is "
+                "required\n",
+                argv[0]);
         usage(argv[0]); // exits
     }
 
-    if (shift < 0) {
+    if (key_list != NULL) {
+        // Keys are reduced as they are parsed, once the alphabet is known
+        long period = caesar_alphabet_period(
+            alphabet != NULL ? alphabet : CAESAR_DEFAULT_ALPHABET, utf8);
+        nkeys = parse_key_list(key_list, period, &keys, &key_names);
+    }
+
+    if (nkeys < 0) {
         fprintf(stderr, "%s: key must be a positive base 10 integer\n",
                 argv[0]);
         usage(argv[0]); // exits
     }
 
+    char *message = argv[optind];
+    size_t message_len = message != NULL ? strlen(message) : 0;
+
+    if (message != NULL && in_path != NULL) {
+        fprintf(stderr, "%s: a message may not be given with -i\n", argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (in_place && (in_path == NULL || out_path != NULL)) {
+        fprintf(stderr, "%s: --in-place requires -i and may not be used with "
+                        "-o\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (mode == cm_crack && alphabet != NULL) {
+        fprintf(stderr, "%s: --alphabet may not be used with --crack\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    // The keys of --all-keys are those of CAESAR_DEFAULT_ALPHABET's period
+    if (all_keys && alphabet != NULL) {
+        fprintf(stderr, "%s: --alphabet may not be used with --all-keys\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (mode == cm_crack && in_place) {
+        fprintf(stderr, "%s: --in-place may not be used with --crack\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (serve_path != NULL &&
+        (nkeys != 1 || message != NULL || in_path != NULL ||
+         out_path != NULL)) {
+        fprintf(stderr, "%s: --serve requires a single key given with -d or -e "
+                        "and no message, -i or -o\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    bool relaying = listen_addr != NULL || forward_addr != NULL;
+    if (relaying &&
+        (listen_addr == NULL || forward_addr == NULL || nkeys != 1 ||
+         mode == cm_crack || message != NULL || in_path != NULL ||
+         out_path != NULL || in_place || use_splice || utf8 || auto_tune ||
+         batch_source != NULL || compressed || ranged || line_buffered ||
+         serve_path != NULL)) {
+        fprintf(stderr, "%s: --listen and --forward must be given together "
+                        "with a single key and no message, -i, -o, "
+                        "--in-place, --splice, --utf8, --auto, --batch, "
+                        "--gzip, --zstd, --offset, --length, "
+                        "--line-buffered, --flush-us or --serve\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (keyword != NULL &&
+        (alphabet != NULL || utf8 || serve_path != NULL)) {
+        fprintf(stderr, "%s: -k and -K may not be used with --alphabet, "
+                        "--utf8 or --serve\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (utf8 && (mode == cm_crack || nkeys != 1 || in_place || use_splice ||
+                 jobs > 1 || serve_path != NULL)) {
+        fprintf(stderr, "%s: --utf8 requires a single key given with -d or -e "
+                        "and may not be used with --in-place, --splice, "
+                        "--serve or -j\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (auto_tune && (hand_tuned || message != NULL || in_place || utf8 ||
+                      nkeys != 1 || mode == cm_crack || serve_path != NULL)) {
+        fprintf(stderr, "%s: --auto requires a single key and streamed input, "
+                        "and may not be used with -b, -j, --in-place, --utf8, "
+                        "--crack or --serve\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (batch_source != NULL &&
+        (nkeys != 1 || mode == cm_crack || message != NULL ||
+         in_path != NULL || out_path != NULL || in_place || use_splice ||
+         utf8 || auto_tune || serve_path != NULL)) {
+        fprintf(stderr, "%s: --batch requires a single key and may not be "
+                        "used with a message, -i, -o, --in-place, --splice, "
+                        "--utf8, --auto, --crack or --serve\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (compressed &&
+        (nkeys != 1 || mode == cm_crack || message != NULL || in_place ||
+         use_splice || jobs > 1 || utf8 || auto_tune || batch_source != NULL ||
+         serve_path != NULL)) {
+        fprintf(stderr, "%s: --gzip and --zstd require a single key and "
+                        "streamed input, and may not be used with -j, "
+                        "--in-place, --splice, --utf8, --auto, --batch, "
+                        "--crack or --serve\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (ranged && (nkeys != 1 || mode == cm_crack || message != NULL ||
+                   in_place || use_splice || jobs > 1 || utf8 || auto_tune ||
+                   batch_source != NULL || compressed || serve_path != NULL)) {
+        fprintf(stderr, "%s: --offset and --length require a single key and "
+                        "a seekable input, and may not be used with -j, "
+                        "--in-place, --splice, --utf8, --auto, --batch, "
+                        "--gzip, --zstd, --crack or --serve\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (line_buffered &&
+        (nkeys != 1 || mode == cm_crack || message != NULL || in_place ||
+         use_splice || jobs > 1 || utf8 || auto_tune || batch_source != NULL ||
+         compressed || ranged || serve_path != NULL)) {
+        fprintf(stderr, "%s: --line-buffered and --flush-us require a single "
+                        "key and streamed input, and may not be used with -j, "
+                        "--in-place, --splice, --utf8, --auto, --batch, "
+                        "--gzip, --zstd, --offset, --length, --crack or "
+                        "--serve\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
+    if (nkeys > 1 && (in_place || use_splice || jobs > 1)) {
+        fprintf(stderr, "%s: --in-place, --splice and -j may not be used with "
+                        "several keys\n",
+                argv[0]);
+        usage(argv[0]); // exits
+    }
+
     /** Encrypt or decrypt message **/
 
-    char *message = argv[optind];
+    if (want_stats) {
+        stats_start();
+    }
+
+    // The crack mode fills in a single key once it is known
+    struct caesar_key *ciphers =
+        calloc(nkeys > 0 ? nkeys : 1, sizeof(*ciphers));
+    if (ciphers == NULL) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+    for (long i = 0; i < nkeys; i++) {
+        // Simply pass in a negative offset for decryption
+        long shift = (mode == cm_encrypt) ? keys[i] : -keys[i];
+        if (keyword != NULL) {
+            if (caesar_key_init_keyword(&ciphers[i], keyword,
+                                        mode == cm_decrypt) < 0) {
+                fprintf(stderr, "%s: keyword must be 1 to %d letters\n",
+                        argv[0], CAESAR_KEYWORD_MAX);
+                usage(argv[0]); // exits
+            }
+        } else if (utf8) {
+            // Only the UTF-8 key below is used
+            caesar_key_init(&ciphers[i], shift);
+        } else if (alphabet == NULL) {
+            caesar_key_init(&ciphers[i], shift);
+        } else if (caesar_key_init_alphabet(&ciphers[i], shift, alphabet) <
+                   0) {
+            fprintf(stderr, "%s: invalid alphabet: %s\n", argv[0], alphabet);
+            usage(argv[0]); // exits
+        }
+    }
+    const struct caesar_key *cipher = &ciphers[0];
+
+    struct caesar_utf8_key utf8_key;
+    if (utf8) {
+        long shift = (mode == cm_encrypt) ? keys[0] : -keys[0];
+        const char *spec =
+            alphabet != NULL ? alphabet : CAESAR_DEFAULT_ALPHABET;
+        if (caesar_utf8_key_init(&utf8_key, shift, spec) < 0) {
+            fprintf(stderr, "%s: invalid alphabet: %s\n", argv[0], spec);
+            usage(argv[0]); // exits
+        }
+    }
+
+    if (relaying) {
+        // Answers go back through the inverse key
+        struct caesar_key inverse;
+        long shift = (mode == cm_encrypt) ? -keys[0] : keys[0];
+        if (keyword != NULL) {
+            caesar_key_init_keyword(&inverse, keyword, mode == cm_encrypt);
+        } else if (alphabet != NULL) {
+            caesar_key_init_alphabet(&inverse, shift, alphabet);
+        } else {
+            caesar_key_init(&inverse, shift);
+        }
+
+        // Default to one thread per CPU, since connections are independent
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t nthreads = jobs_given ? jobs : ncpus > 0 ? ncpus : 1;
+        if (relay(cipher, &inverse, listen_addr, forward_addr, nthreads) <
+            0) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (serve_path != NULL) {
+        if (serve(cipher, serve_path) < 0) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], serve_path,
+                    strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
 
-    // Simply pass in a negative offset for decryption
-    shift = (mode == cm_encrypt) ? shift : -shift;
+    if (batch_source != NULL) {
+        // Default to one thread per CPU, since files are independent
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t nthreads = jobs_given ? jobs : ncpus > 0 ? ncpus : 1;
+        char *failed_path;
+        if (crypt_batch(cipher, batch_source, nthreads, &failed_path) < 0) {
+            if (failed_path != NULL) {
+                fprintf(stderr, "%s: %s: %s\n", argv[0], failed_path,
+                        strerror(errno));
+            } else {
+                fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            }
+            free(failed_path);
+            return 1;
+        }
+        return 0;
+    }
 
+    int in_fd = STDIN_FILENO;
+    if (in_path != NULL) {
+        in_fd = open(in_path, in_place ? O_RDWR : O_RDONLY);
+        if (in_fd < 0) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], in_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    if (nkeys > 1) {
+        return crypt_multi(argv[0], ciphers, key_names, nkeys, message,
+                           message_len, in_fd, out_path, block_size);
+    }
+
+    if (in_place) {
+        if (crypt_file_in_place(cipher, in_fd, jobs) < 0) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], in_path, strerror(errno));
+            return 1;
+        }
+        close(in_fd);
+        return 0;
+    }
+
+    FILE *out = stdout;
+    if (out_path != NULL) {
+        out = fopen(out_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], out_path,
+                    strerror(errno));
+            return 1;
+        }
+    }
+
+    int cracked_key = 0;
     if (message == NULL) {
-        crypt_stream(shift, stdin, stdout);
+        int ret;
+        if (utf8) {
+            ret = crypt_stream_utf8(&utf8_key, in_fd, fileno(out), block_size);
+        } else if (ranged) {
+            ret = crypt_file_range(cipher, in_fd, fileno(out), range_offset,
+                                   range_length < 0 ? UINT64_MAX
+                                                    : (uint64_t)range_length,
+                                   block_size);
+        } else if (line_buffered) {
+            ret = crypt_stream_lines(cipher, in_fd, fileno(out), block_size,
+                                     flush_us);
+        } else if (compressed) {
+            ret = crypt_stream_compressed(cipher, format, in_fd, fileno(out),
+                                          block_size);
+        } else if (auto_tune) {
+            ret = crypt_stream_auto(cipher, in_fd, fileno(out), use_splice,
+                                    tune_cache);
+        } else if (mode == cm_crack) {
+            ret = crack_stream(in_fd, fileno(out), block_size, jobs,
+                               use_splice, &cracked_key);
+        } else {
+            ret = crypt_stream_with(cipher, in_fd, fileno(out), block_size,
+                                    jobs, use_splice);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            return 1;
+        }
     } else {
-        crypt_str(shift, message, stdout);
+        if (mode == cm_crack) {
+            struct byte_hist hist = {{0}};
+            bool confident;
+            byte_hist_add(&hist, message, message_len);
+            crack_score(&hist, &cracked_key, &confident);
+            caesar_key_init(&ciphers[0], -cracked_key);
+        }
+        int ret;
+        if (utf8) {
+            caesar_utf8_transform_inplace(&utf8_key, (uint8_t *)message,
+                                          message_len);
+            ret = fwrite(message, 1, message_len, out) == message_len ? 0 : -1;
+        } else {
+            ret = crypt_str(cipher, message, message_len, out);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+            return 1;
+        }
     }
 
-    // Add a newline if stdout is a terminal, for readability
-    if (isatty(STDOUT_FILENO)) {
-        fputc('\n', stdout);
+    // Add a newline if the output is a terminal, for readability
+    if (isatty(fileno(out))) {
+        fputc('\n', out);
     }
 
+    if (fclose(out) != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+
+    if (mode == cm_crack) {
+        fprintf(stderr, "%s: recovered key %d\n", argv[0], cracked_key);
+    }
+
+    free(ciphers);
+    free(keys);
+    if (key_names != NULL) {
+        free(key_names[0]);
+        free(key_names);
+    }
     return 0;
 }
\ No newline at end of file
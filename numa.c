@@ -0,0 +1,215 @@
+/**
+ * @file numa.c
+ * NUMA topology, read from sysfs, used to place worker threads and buffers.
+ */
+#define _GNU_SOURCE
+#include "numa.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Directory holding one nodeN directory per NUMA node */
+#define NUMA_SYSFS "/sys/devices/system/node"
+
+/** Longest CPU list formatted by numa_report() */
+#define CPULIST_MAX 1024
+
+/**
+ * @brief Parse a CPU list such as "0-3,8-11" from a sysfs file
+ * @param path  Path of the file
+ * @param cpus  Set to the CPUs listed
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int read_cpulist(const char *path, cpu_set_t *cpus)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+
+    CPU_ZERO(cpus);
+    int first;
+    int last;
+    int ret = 0;
+    while (fscanf(in, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(in);
+        if (c == '-') {
+            if (fscanf(in, "%d", &last) != 1) {
+                errno = EINVAL;
+                ret = -1;
+                break;
+            }
+            c = fgetc(in);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+
+    fclose(in);
+    return ret;
+}
+
+/**
+ * @brief Format a set of CPUs as a list of ranges like sysfs does
+ * @param cpus  Set of CPUs
+ * @param buf   Buffer of CPULIST_MAX bytes to hold the list
+ */
+static void format_cpulist(const cpu_set_t *cpus, char *buf)
+{
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, cpus)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) {
+            last++;
+        }
+        int n = last > cpu ? snprintf(buf + len, CPULIST_MAX - len, "%s%d-%d",
+                                      len > 0 ? "," : "", cpu, last)
+                           : snprintf(buf + len, CPULIST_MAX - len, "%s%d",
+                                      len > 0 ? "," : "", cpu);
+        if (n < 0 || (size_t)n >= CPULIST_MAX - len) {
+            break;
+        }
+        len += n;
+        cpu = last;
+    }
+}
+
+/**
+ * @brief Compare two nodes by number, for qsort()
+ * @param a First node
+ * @param b Second node
+ * @return Negative, zero or positive as a is less, equal or greater than b
+ */
+static int node_cmp(const void *a, const void *b)
+{
+    const struct numa_node *x = a;
+    const struct numa_node *y = b;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+void numa_read(struct numa *numa)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        CPU_ZERO(&allowed);
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long cpu = 0; cpu < ncpus && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &allowed);
+        }
+    }
+
+    numa->nnodes = 0;
+    DIR *dir = opendir(NUMA_SYSFS);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL &&
+           numa->nnodes < NUMA_MAX_NODES) {
+        int id;
+        char extra;
+        if (sscanf(entry->d_name, "node%d%c", &id, &extra) != 1) {
+            continue;
+        }
+
+        char path[64];
+        snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/cpulist", id);
+        struct numa_node *node = &numa->nodes[numa->nnodes];
+        if (read_cpulist(path, &node->cpus) < 0) {
+            continue;
+        }
+        CPU_AND(&node->cpus, &node->cpus, &allowed);
+        node->ncpus = CPU_COUNT(&node->cpus);
+        if (node->ncpus > 0) {
+            node->id = id;
+            numa->nnodes++;
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    qsort(numa->nodes, numa->nnodes, sizeof(numa->nodes[0]), node_cmp);
+
+    if (numa->nnodes == 0) {
+        numa->nodes[0].id = 0;
+        numa->nodes[0].cpus = allowed;
+        numa->nodes[0].ncpus = CPU_COUNT(&allowed);
+        numa->nnodes = 1;
+    }
+}
+
+int numa_cpu(const struct numa *numa, size_t node, size_t i)
+{
+    const struct numa_node *n = &numa->nodes[node];
+    size_t nth = n->ncpus > 0 ? i % n->ncpus : 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &n->cpus) && nth-- == 0) {
+            return cpu;
+        }
+    }
+    return 0;
+}
+
+size_t numa_routes(const struct numa *numa, size_t nthreads)
+{
+    return numa->nnodes < nthreads ? numa->nnodes : nthreads;
+}
+
+int numa_report(size_t jobs)
+{
+    struct numa numa;
+    numa_read(&numa);
+
+    for (size_t i = 0; i < numa.nnodes; i++) {
+        const struct numa_node *node = &numa.nodes[i];
+        char cpus[CPULIST_MAX];
+        format_cpulist(&node->cpus, cpus);
+
+        // Memory is unknown without NUMA information in sysfs
+        char path[64];
+        snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/meminfo", node->id);
+        FILE *in = fopen(path, "r");
+        long long mem_total = -1;
+        long long mem_free = -1;
+        char line[256];
+        while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+            sscanf(line, "Node %*d MemTotal: %lld", &mem_total);
+            sscanf(line, "Node %*d MemFree: %lld", &mem_free);
+        }
+        if (in != NULL) {
+            fclose(in);
+        }
+
+        printf("{\"node\":%d,\"cpus\":\"%s\"", node->id, cpus);
+        if (mem_total >= 0 && mem_free >= 0) {
+            printf(",\"mem_total_kb\":%lld,\"mem_free_kb\":%lld}\n",
+                   mem_total, mem_free);
+        } else {
+            printf(",\"mem_total_kb\":null,\"mem_free_kb\":null}\n");
+        }
+    }
+
+    // Placement as done by crypt_stream_parallel()
+    size_t nroutes = numa_routes(&numa, jobs);
+    for (size_t i = 0; i < jobs; i++) {
+        size_t route = i % nroutes;
+        printf("{\"worker\":%zu,\"node\":%d", i, numa.nodes[route].id);
+        if (nroutes > 1) {
+            printf(",\"cpu\":%d}\n", numa_cpu(&numa, route, i / nroutes));
+        } else {
+            printf(",\"cpu\":null}\n");
+        }
+    }
+
+    return fflush(stdout) == 0 ? 0 : -1;
+}
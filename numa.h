@@ -0,0 +1,71 @@
+/**
+ * @file numa.h
+ * NUMA topology, read from sysfs, used to place worker threads and buffers.
+ */
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <sched.h>
+#include <stddef.h>
+
+/** Largest number of NUMA nodes taken into account */
+#define NUMA_MAX_NODES 64
+
+/** NUMA node with at least one CPU this process may run on */
+struct numa_node {
+    int id;         /**< Number of the node in sysfs */
+    cpu_set_t cpus; /**< CPUs of the node this process may run on */
+    size_t ncpus;
+};
+
+/** Nodes of the machine, or a single node of every CPU without NUMA */
+struct numa {
+    struct numa_node nodes[NUMA_MAX_NODES];
+    size_t nnodes;
+};
+
+/**
+ * @brief Read the NUMA topology from /sys/devices/system/node
+ *
+ * Only CPUs in this process's affinity mask are counted, and nodes without
+ * any are left out. Without NUMA information, all CPUs the process may run on
+ * are taken to be a single node.
+ *
+ * @param numa  Topology to fill in
+ */
+void numa_read(struct numa *numa);
+
+/**
+ * @brief Pick a CPU of a node, spreading successive indices over its CPUs
+ * @param numa  Topology
+ * @param node  Index of the node in numa->nodes
+ * @param i     Index of the thread among those placed on the node
+ * @return CPU number
+ */
+int numa_cpu(const struct numa *numa, size_t node, size_t i);
+
+/**
+ * @brief Number of nodes a pool of worker threads is spread over
+ *
+ * Workers go to the nodes in turn, so with fewer workers than nodes only the
+ * first nodes get any. Workers are only pinned when spread over more than one
+ * node, as placement does not matter otherwise.
+ *
+ * @param numa      Topology
+ * @param nthreads  Number of worker threads
+ * @return Number of nodes with at least one worker
+ */
+size_t numa_routes(const struct numa *numa, size_t nthreads);
+
+/**
+ * @brief Print the topology and where -j would place each worker
+ *
+ * Each node is printed as a line of JSON with its CPUs and memory, followed by
+ * one line per worker with the node and CPU it would be pinned to.
+ *
+ * @param jobs  Number of worker threads to place
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int numa_report(size_t jobs);
+
+#endif
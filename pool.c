@@ -0,0 +1,139 @@
+/**
+ * @file pool.c
+ * Pool of fixed-size buffers handed between the stages of an engine.
+ */
+#define _GNU_SOURCE
+#include "pool.h"
+
+#include "stats.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+int pool_init(struct pool *pool, size_t buf_size, size_t nbufs,
+              size_t nlists)
+{
+    *pool = (struct pool){0};
+    if (buf_size == 0 || nbufs == 0 || nlists == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nlists > nbufs) {
+        nlists = nbufs;
+    }
+
+    pool->buf_size = (buf_size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+    pool->nbufs = nbufs;
+    pool->nlists = nlists;
+    pool->per_list = (nbufs + nlists - 1) / nlists;
+    if (pool->buf_size < buf_size || SIZE_MAX / pool->buf_size < nbufs) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pool->map_size = pool->buf_size * nbufs;
+
+    pool->base = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    // Aligned, so no two lists share a cache line
+    pool->lists = aligned_alloc(POOL_ALIGN, nlists * sizeof(*pool->lists));
+    pool->indices = calloc(nbufs, sizeof(*pool->indices));
+    if (pool->base == MAP_FAILED || pool->lists == NULL ||
+        pool->indices == NULL) {
+        int saved_errno = errno;
+        if (pool->base != MAP_FAILED) {
+            munmap(pool->base, pool->map_size);
+        }
+        free(pool->lists);
+        free(pool->indices);
+        *pool = (struct pool){0};
+        errno = saved_errno;
+        return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(pool->base, pool->map_size, MADV_HUGEPAGE);
+#endif
+
+    for (size_t i = 0; i < nlists; i++) {
+        struct pool_list *list = &pool->lists[i];
+        pthread_mutex_init(&list->lock, NULL);
+        // With uneven lists, the last ones may own fewer buffers or none
+        size_t first = i * pool->per_list < nbufs ? i * pool->per_list : nbufs;
+        size_t end = first + pool->per_list < nbufs ? first + pool->per_list
+                                                    : nbufs;
+        list->free = &pool->indices[first];
+        list->nfree = 0;
+
+        // Pushed in reverse, so buffers are handed out in address order
+        for (size_t buf = end; buf > first; buf--) {
+            list->free[list->nfree++] = buf - 1;
+        }
+    }
+    return 0;
+}
+
+void *pool_get(struct pool *pool, size_t list)
+{
+    size_t index = SIZE_MAX;
+    for (size_t i = 0; i < pool->nlists && index == SIZE_MAX; i++) {
+        struct pool_list *from = &pool->lists[(list + i) % pool->nlists];
+        pthread_mutex_lock(&from->lock);
+        if (from->nfree > 0) {
+            index = from->free[--from->nfree];
+        }
+        pthread_mutex_unlock(&from->lock);
+    }
+
+    if (index == SIZE_MAX) {
+        __atomic_fetch_add(&pool->exhausted, 1, __ATOMIC_RELAXED);
+        if (stats != NULL) {
+            stats_add(&stats->pool_exhausted, 1);
+        }
+        return NULL;
+    }
+
+    size_t in_use = __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+    size_t high_water = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+    while (high_water < in_use &&
+           !__atomic_compare_exchange_n(&pool->high_water, &high_water,
+                                        in_use, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+    if (stats != NULL) {
+        stats_max(&stats->pool_high_water, in_use);
+    }
+    return pool->base + index * pool->buf_size;
+}
+
+void pool_put(struct pool *pool, void *buf)
+{
+    size_t index = ((char *)buf - pool->base) / pool->buf_size;
+    struct pool_list *list = &pool->lists[index / pool->per_list];
+
+    pthread_mutex_lock(&list->lock);
+    list->free[list->nfree++] = index;
+    pthread_mutex_unlock(&list->lock);
+    __atomic_fetch_sub(&pool->in_use, 1, __ATOMIC_RELAXED);
+}
+
+bool pool_owns(const struct pool *pool, const void *buf)
+{
+    const char *p = buf;
+    return pool->base != NULL && p >= pool->base &&
+           p < pool->base + pool->map_size;
+}
+
+void pool_destroy(struct pool *pool)
+{
+    if (pool->base == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < pool->nlists; i++) {
+        pthread_mutex_destroy(&pool->lists[i].lock);
+    }
+    munmap(pool->base, pool->map_size);
+    free(pool->lists);
+    free(pool->indices);
+    *pool = (struct pool){0};
+}
@@ -0,0 +1,93 @@
+/**
+ * @file pool.h
+ * Pool of fixed-size buffers handed between the stages of an engine.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Alignment of every buffer of a pool, the size of a cache line */
+#define POOL_ALIGN 64
+
+/**
+ * Free list of a pool. Each list owns a contiguous range of the buffers, and
+ * a buffer always goes back to the list owning it.
+ */
+struct pool_list {
+    pthread_mutex_t lock;
+    size_t *free; /**< Stack of the indices of free buffers */
+    size_t nfree;
+} __attribute__((aligned(POOL_ALIGN)));
+
+/**
+ * Pool of equally sized buffers carved out of a single mapping, so getting
+ * and putting buffers never calls malloc() or free(). The mapping is advised
+ * to use transparent huge pages.
+ *
+ * Memory is only backed once it is first written to, and Linux places it on
+ * the NUMA node of the thread that does so. Since each list owns its own
+ * range of buffers, a worker that only gets buffers from its own list keeps
+ * using memory local to it.
+ */
+struct pool {
+    char *base;
+    size_t map_size;
+    size_t buf_size; /**< Size of each buffer, a multiple of POOL_ALIGN */
+    size_t nbufs;
+    size_t per_list; /**< Number of buffers owned by each list */
+    struct pool_list *lists;
+    size_t nlists;
+    size_t *indices;   /**< Storage of every list's stack */
+    size_t in_use;     /**< Buffers currently handed out */
+    size_t high_water; /**< Most buffers handed out at once */
+    size_t exhausted;  /**< Calls to pool_get() that found no free buffer */
+};
+
+/**
+ * @brief Create a pool of buffers
+ * @param pool      Pool to initialize
+ * @param buf_size  Minimum size of each buffer in bytes
+ * @param nbufs     Number of buffers
+ * @param nlists    Number of free lists, usually one per worker
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int pool_init(struct pool *pool, size_t buf_size, size_t nbufs,
+              size_t nlists);
+
+/**
+ * @brief Take a buffer from a pool, from a given list if it has one
+ *
+ * If the list is empty, a buffer is taken from any other list instead. Safe
+ * to call from any thread.
+ *
+ * @param pool  Pool to take from
+ * @param list  Index of the preferred list, taken modulo the number of lists
+ * @return Buffer of pool->buf_size bytes, or NULL if every buffer is in use
+ */
+void *pool_get(struct pool *pool, size_t list);
+
+/**
+ * @brief Return a buffer to the list owning it
+ * @param pool  Pool the buffer was taken from
+ * @param buf   Buffer returned by pool_get()
+ */
+void pool_put(struct pool *pool, void *buf);
+
+/**
+ * @brief Check whether a buffer belongs to a pool
+ * @param pool  Pool to check
+ * @param buf   Any pointer
+ * @return true if buf was returned by pool_get() on this pool
+ */
+bool pool_owns(const struct pool *pool, const void *buf);
+
+/**
+ * @brief Release a pool's mapping once all of its buffers have been returned
+ * @param pool  Pool to release
+ */
+void pool_destroy(struct pool *pool);
+
+#endif
@@ -0,0 +1,719 @@
+/**
+ * @file relay.c
+ * TCP relay crypting the traffic between its clients and a forward address.
+ */
+#define _GNU_SOURCE
+#include "relay.h"
+
+#include "pool.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/** Number of epoll events handled per wakeup */
+#define RELAY_MAX_EVENTS 256
+
+/** Size of each buffer a direction of a connection receives into */
+#define RELAY_BUF_SIZE (64 * 1024)
+
+/**
+ * Number of buffers of each direction. A buffer sent with MSG_ZEROCOPY is
+ * only reused once the peer acknowledged it, so the others keep the stream
+ * going meanwhile.
+ */
+#define RELAY_RING 16
+
+/** Number of pooled buffers, beyond which connections use the heap */
+#define RELAY_POOL_BUFS 1024
+
+/** Send and receive buffer size asked for on every socket */
+#define RELAY_SOCKET_BUF (4 * 1024 * 1024)
+
+/**
+ * Smallest send made with MSG_ZEROCOPY. Pinning pages and reaping the
+ * completion costs more than copying small sends.
+ */
+#define RELAY_ZEROCOPY_MIN (16 * 1024)
+
+/** Buffer of crypted bytes in the ring of a direction */
+struct relay_slot {
+    uint8_t *data;   /**< RELAY_BUF_SIZE bytes, or NULL */
+    size_t len;      /**< Number of bytes in data */
+    size_t sent;     /**< Bytes at the start of data already sent */
+    uint32_t zc_seq; /**< Value of zc_done once the kernel is done with data */
+};
+
+/**
+ * One direction of a relayed connection. Slots are received into, sent and
+ * then reused in turn, the counts of each only growing and wrapping around.
+ */
+struct relay_dir {
+    int from;
+    int to;
+    const struct caesar_key *key;
+    struct relay_slot ring[RELAY_RING];
+    uint32_t filled;  /**< Number of slots received into */
+    uint32_t flushed; /**< Number of them sent in full */
+    uint32_t freed;   /**< Number of those the kernel no longer needs */
+    uint64_t pos;     /**< Offset in the stream of the next byte received */
+    bool zerocopy;    /**< Whether to takes MSG_ZEROCOPY sends */
+    uint32_t zc_sent; /**< Number of MSG_ZEROCOPY sends made on to */
+    uint32_t zc_done; /**< Number of them the kernel no longer needs */
+    bool ended;       /**< Whether from reached the end of its stream */
+    bool eof;         /**< Whether the end was passed on to to */
+};
+
+/**
+ * @brief Whether a direction is over, all of it sent and no longer needed
+ * @param dir   Direction
+ * @return Whether the direction is over
+ */
+static bool relay_done(const struct relay_dir *dir)
+{
+    return dir->eof && dir->freed == dir->filled;
+}
+
+/** Client connection and its connection to the forward address */
+struct relay_conn {
+    struct relay_dir dirs[2]; /**< Client to forward address, and back */
+};
+
+/** Settings and resources shared by the workers */
+struct relay_shared {
+    const struct caesar_key *up;
+    const struct caesar_key *down;
+    struct addrinfo *listen_ai;
+    struct addrinfo *forward_ai;
+    struct pool pool;
+};
+
+/** Worker thread with its own listening socket and epoll instance */
+struct relay_worker {
+    struct relay_shared *shared;
+    size_t index; /**< Index of the worker, also its list in the pool */
+    pthread_t thread;
+    int err; /**< errno of the failure that stopped the worker, or 0 */
+};
+
+/** Set by the signal handler or a failing worker to stop the relay */
+static volatile sig_atomic_t stop;
+
+/** eventfd in every worker's epoll instance, written to wake them to stop */
+static int wake_fd = -1;
+
+/**
+ * @brief Signal handler asking the relay to stop
+ * @param sig   Signal number
+ */
+static void relay_stop(int sig)
+{
+    (void)sig;
+    stop = 1;
+    uint64_t one = 1;
+    // Only fails if the counter would overflow, when workers are awake anyway
+    ssize_t ignored = write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+#ifdef RELAY_NUMERIC_HOSTS
+/** Address parsed by relay_parse_numeric(), freed with a single free() */
+struct relay_numeric_ai {
+    struct addrinfo ai;
+    struct sockaddr_storage addr;
+};
+
+/**
+ * @brief Parse a numeric host and port into a single address
+ *
+ * Used by the statically linked build instead of getaddrinfo(), which needs
+ * the shared libraries of the glibc it was linked with at run time even for
+ * numeric addresses. Host names and service names are not resolved.
+ *
+ * @param host      IPv4 or IPv6 address, or NULL for any IPv4 address
+ * @param port      Decimal port
+ * @param res       Set to the address on success
+ * @return 0 on success, or -1 on failure with errno set to EINVAL if the port
+ *         is not a number or EADDRNOTAVAIL if the host is not an address
+ */
+static int relay_parse_numeric(const char *host, const char *port,
+                               struct addrinfo **res)
+{
+    char *end;
+    errno = 0;
+    unsigned long num = strtoul(port, &end, 10);
+    if (errno != 0 || *end != '\0' || *port < '0' || *port > '9' ||
+        num > UINT16_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct relay_numeric_ai *entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        return -1;
+    }
+    struct sockaddr_in *in4 = (struct sockaddr_in *)&entry->addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&entry->addr;
+    if (host == NULL || inet_pton(AF_INET, host, &in4->sin_addr) == 1) {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons(num);
+        entry->ai.ai_addrlen = sizeof(*in4);
+    } else if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(num);
+        entry->ai.ai_addrlen = sizeof(*in6);
+    } else {
+        free(entry);
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+    entry->ai.ai_family = entry->addr.ss_family;
+    entry->ai.ai_socktype = SOCK_STREAM;
+    entry->ai.ai_protocol = IPPROTO_TCP;
+    entry->ai.ai_addr = (struct sockaddr *)&entry->addr;
+    *res = &entry->ai;
+    return 0;
+}
+#endif
+
+/**
+ * @brief Free the addresses set by relay_resolve()
+ * @param ai    Addresses, or NULL
+ */
+static void relay_free_addresses(struct addrinfo *ai)
+{
+    if (ai == NULL) {
+        return;
+    }
+#ifdef RELAY_NUMERIC_HOSTS
+    free(ai);
+#else
+    freeaddrinfo(ai);
+#endif
+}
+
+/**
+ * @brief Resolve an address given as host:port
+ * @param addr      Address, where host may be empty or missing if passive,
+ *                  and an IPv6 host may be given in brackets
+ * @param passive   Whether the address is to listen on
+ * @param res       Set to the resolved addresses on success
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int relay_resolve(const char *addr, bool passive, struct addrinfo **res)
+{
+    char *copy = strdup(addr);
+    if (copy == NULL) {
+        return -1;
+    }
+    char *host = NULL;
+    char *port = copy;
+    char *colon = strrchr(copy, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        host = copy;
+        port = colon + 1;
+        size_t len = strlen(host);
+        if (len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+            host[len - 1] = '\0';
+            host++;
+        }
+    }
+    if (host != NULL && *host == '\0') {
+        host = NULL;
+    }
+    // Workers each bind a socket of their own, so they need the same port
+    if (*port == '\0' || (host == NULL && !passive) ||
+        (passive && strspn(port, "0") == strlen(port))) {
+        free(copy);
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef RELAY_NUMERIC_HOSTS
+    int ret = relay_parse_numeric(host, port, res);
+    int saved_errno = errno;
+    free(copy);
+    errno = saved_errno;
+    return ret;
+#else
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = passive ? AI_PASSIVE : 0,
+    };
+    int gai = getaddrinfo(host, port, &hints, res);
+    free(copy);
+    if (gai != 0) {
+        errno = gai == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+/**
+ * @brief Set the options every relayed socket gets
+ *
+ * Large buffers let a fast sender run ahead of a slow receiver, and disabling
+ * Nagle's algorithm forwards small writes without delay. Failures only cost
+ * speed.
+ *
+ * @param fd    Connected or connecting TCP socket
+ * @return Whether the socket takes MSG_ZEROCOPY sends
+ */
+static bool relay_tune_socket(int fd)
+{
+    int size = RELAY_SOCKET_BUF;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_ZEROCOPY
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Create a worker's listening socket
+ * @param ai    Addresses to listen on, tried in turn
+ * @return Socket descriptor, or -1 on failure with errno set
+ */
+static int relay_listen(const struct addrinfo *ai)
+{
+    int err = EADDRNOTAVAIL;
+    for (; ai != NULL; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family,
+                        ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) ==
+                0 &&
+            bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SOMAXCONN) == 0) {
+            return fd;
+        }
+        err = errno;
+        close(fd);
+    }
+    errno = err;
+    return -1;
+}
+
+/**
+ * @brief Collect the kernel's notices that it is done with zero-copy sends
+ * @param dir   Direction whose sends to reap
+ */
+static void relay_reap(struct relay_dir *dir)
+{
+    while (dir->zc_done != dir->zc_sent) {
+        char control[128];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        if (recvmsg(dir->to, &msg, MSG_ERRQUEUE) < 0) {
+            return;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            const struct sock_extended_err *ee = (void *)CMSG_DATA(cmsg);
+            // Notices cover the inclusive range of sends [ee_info, ee_data]
+            if (ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY && ee->ee_errno == 0 &&
+                ee->ee_data + 1 - dir->zc_done <=
+                    dir->zc_sent - dir->zc_done) {
+                dir->zc_done = ee->ee_data + 1;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Give the buffers of a direction back to the pool or the heap
+ * @param pool  Pool of buffers
+ * @param dir   Direction whose slots are all free
+ */
+static void relay_release(struct pool *pool, struct relay_dir *dir)
+{
+    for (size_t i = 0; i < RELAY_RING; i++) {
+        struct relay_slot *slot = &dir->ring[i];
+        if (pool_owns(pool, slot->data)) {
+            pool_put(pool, slot->data);
+        } else {
+            free(slot->data);
+        }
+        slot->data = NULL;
+    }
+}
+
+/**
+ * @brief Send as much of the filled slots of a direction as to takes
+ * @param dir   Direction to send along
+ * @return 1 if everything was sent, 0 if to is full, or -1 if it failed
+ */
+static int relay_send(struct relay_dir *dir)
+{
+    while (dir->flushed != dir->filled) {
+        struct relay_slot *slot = &dir->ring[dir->flushed % RELAY_RING];
+        size_t left = slot->len - slot->sent;
+        int flags = MSG_NOSIGNAL;
+#ifdef MSG_ZEROCOPY
+        bool zerocopy = dir->zerocopy && left >= RELAY_ZEROCOPY_MIN;
+        flags |= zerocopy ? MSG_ZEROCOPY : 0;
+#else
+        bool zerocopy = false;
+#endif
+        uint64_t start = stats_clock();
+        ssize_t sent = send(dir->to, slot->data + slot->sent, left, flags);
+        if (stats != NULL) {
+            stats_io(&stats->writes, &stats->write_ns, &stats->bytes_written,
+                     start, sent);
+        }
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (zerocopy && errno == ENOBUFS) {
+                // Out of pinned memory, so copy from now on
+                dir->zerocopy = false;
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        dir->zc_sent += zerocopy;
+        slot->zc_seq = dir->zc_sent;
+        slot->sent += sent;
+        if (slot->sent == slot->len) {
+            dir->flushed++;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Move as many bytes along a direction as its sockets take
+ *
+ * Bytes are received into the free slots of the ring, crypted a slot at a
+ * time and sent on in order. Receiving goes on while to is full or the kernel
+ * still sends from earlier slots, until no slot is free. The buffers are
+ * released whenever the direction runs dry, so idle connections hold none.
+ *
+ * @param worker    Worker the connection belongs to
+ * @param dir       Direction to pump
+ * @return 0 on success, or -1 if the connection failed
+ */
+static int relay_pump(struct relay_worker *worker, struct relay_dir *dir)
+{
+    struct pool *pool = &worker->shared->pool;
+    bool blocked = false; // Whether to was full during this call
+    for (;;) {
+        if (!blocked) {
+            int sent = relay_send(dir);
+            if (sent < 0) {
+                return -1;
+            }
+            blocked = sent == 0;
+        }
+        // The kernel may still be sending straight from sent slots
+        relay_reap(dir);
+        while (dir->freed != dir->flushed &&
+               (int32_t)(dir->zc_done -
+                         dir->ring[dir->freed % RELAY_RING].zc_seq) >= 0) {
+            dir->freed++;
+        }
+
+        if (dir->ended) {
+            // Pass the end of the stream on once everything before it is sent
+            if (!dir->eof && dir->flushed == dir->filled) {
+                dir->eof = true;
+                shutdown(dir->to, SHUT_WR);
+            }
+            return 0;
+        }
+        if (dir->filled - dir->freed == RELAY_RING) {
+            return 0;
+        }
+
+        struct relay_slot *slot = &dir->ring[dir->filled % RELAY_RING];
+        if (slot->data == NULL) {
+            slot->data = pool_get(pool, worker->index);
+            if (slot->data == NULL &&
+                (slot->data = malloc(RELAY_BUF_SIZE)) == NULL) {
+                return -1;
+            }
+        }
+
+        uint64_t start = stats_clock();
+        ssize_t got = recv(dir->from, slot->data, RELAY_BUF_SIZE, 0);
+        if (stats != NULL) {
+            stats_io(&stats->reads, &stats->read_ns, &stats->bytes_read, start,
+                     got);
+        }
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (dir->freed == dir->filled) {
+                relay_release(pool, dir);
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (got == 0) {
+            dir->ended = true;
+            continue;
+        }
+
+        start = stats_clock();
+        caesar_transform_inplace_at(dir->key, dir->pos, slot->data, got);
+        if (stats != NULL) {
+            stats_add(&stats->transform_ns, stats_clock() - start);
+        }
+        dir->pos += got;
+        *slot = (struct relay_slot){.data = slot->data, .len = got};
+        dir->filled++;
+    }
+}
+
+/**
+ * @brief Close both sockets of a connection and release its buffers
+ * @param worker    Worker the connection belongs to
+ * @param epoll_fd  Worker's epoll instance
+ * @param conn      Connection to close
+ */
+static void relay_close(struct relay_worker *worker, int epoll_fd,
+                        struct relay_conn *conn)
+{
+    for (int i = 0; i < 2; i++) {
+        struct relay_dir *dir = &conn->dirs[i];
+        relay_reap(dir);
+        if (dir->zc_done != dir->zc_sent) {
+            // Reset rather than let the kernel send from a reused buffer
+            struct linger abort = {.l_onoff = 1, .l_linger = 0};
+            setsockopt(dir->to, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        struct relay_dir *dir = &conn->dirs[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dir->from, NULL);
+        close(dir->from);
+        relay_release(&worker->shared->pool, dir);
+    }
+    free(conn);
+}
+
+/**
+ * @brief Accept a client and start connecting to the forward address for it
+ * @param worker    Worker taking the client
+ * @param epoll_fd  Worker's epoll instance
+ * @param client    Accepted client socket
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int relay_accept(struct relay_worker *worker, int epoll_fd, int client)
+{
+    const struct addrinfo *ai = worker->shared->forward_ai;
+    int upstream = socket(ai->ai_family,
+                          ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          ai->ai_protocol);
+    struct relay_conn *conn = calloc(1, sizeof(*conn));
+    if (upstream < 0 || conn == NULL) {
+        goto fail;
+    }
+    bool client_zerocopy = relay_tune_socket(client);
+    bool upstream_zerocopy = relay_tune_socket(upstream);
+    if (connect(upstream, ai->ai_addr, ai->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+        goto fail;
+    }
+
+    conn->dirs[0] = (struct relay_dir){
+        .from = client,
+        .to = upstream,
+        .key = worker->shared->up,
+        .zerocopy = upstream_zerocopy,
+    };
+    conn->dirs[1] = (struct relay_dir){
+        .from = upstream,
+        .to = client,
+        .key = worker->shared->down,
+        .zerocopy = client_zerocopy,
+    };
+
+    // Either socket becoming ready may let both directions move
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = conn,
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &ev) < 0) {
+        goto fail;
+    }
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, upstream, &ev) < 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client, NULL);
+        goto fail;
+    }
+    return 0;
+
+fail:;
+    int saved_errno = errno;
+    close(client);
+    if (upstream >= 0) {
+        close(upstream);
+    }
+    free(conn);
+    errno = saved_errno;
+    return -1;
+}
+
+/**
+ * @brief Serve the connections of one worker until the relay stops
+ * @param arg   Worker
+ * @return NULL, with worker->err set on failure
+ */
+static void *relay_worker(void *arg)
+{
+    struct relay_worker *worker = arg;
+    int listen_fd = relay_listen(worker->shared->listen_ai);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_ev = {.events = EPOLLIN, .data.ptr = NULL};
+    struct epoll_event wake_ev = {.events = EPOLLIN, .data.ptr = &wake_fd};
+    if (listen_fd < 0 || epoll_fd < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_ev) < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &wake_ev) < 0) {
+        worker->err = errno;
+        goto out;
+    }
+
+    struct epoll_event events[RELAY_MAX_EVENTS];
+    while (!stop) {
+        int n = epoll_wait(epoll_fd, events, RELAY_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            worker->err = errno;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &wake_fd) {
+                continue;
+            }
+            if (ptr == NULL) {
+                // Clients failing to be set up are dropped, the relay goes on
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL,
+                                     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    relay_accept(worker, epoll_fd, fd);
+                }
+                continue;
+            }
+
+            struct relay_conn *conn = ptr;
+            bool failed = relay_pump(worker, &conn->dirs[0]) < 0 ||
+                          relay_pump(worker, &conn->dirs[1]) < 0;
+            if (failed ||
+                (relay_done(&conn->dirs[0]) && relay_done(&conn->dirs[1]))) {
+                relay_close(worker, epoll_fd, conn);
+                // It may come up again in this wakeup, once per socket
+                for (int j = i + 1; j < n; j++) {
+                    if (events[j].data.ptr == conn) {
+                        events[j].data.ptr = &wake_fd;
+                    }
+                }
+            }
+        }
+    }
+
+out:
+    // Connections still open are released by process exit
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+    if (worker->err != 0) {
+        relay_stop(0);
+    }
+    return NULL;
+}
+
+int relay(const struct caesar_key *up, const struct caesar_key *down,
+          const char *listen, const char *forward, size_t nthreads)
+{
+    struct relay_shared shared = {.up = up, .down = down};
+    struct relay_worker *workers = calloc(nthreads, sizeof(*workers));
+    int ret = -1;
+    size_t started = 0;
+    if (workers == NULL || relay_resolve(listen, true, &shared.listen_ai) < 0 ||
+        relay_resolve(forward, false, &shared.forward_ai) < 0 ||
+        pool_init(&shared.pool, RELAY_BUF_SIZE, RELAY_POOL_BUFS, nthreads) <
+            0 ||
+        (wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        goto out;
+    }
+
+    struct sigaction sa = {.sa_handler = relay_stop};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int err = 0;
+    for (; started < nthreads; started++) {
+        workers[started] =
+            (struct relay_worker){.shared = &shared, .index = started};
+        err = pthread_create(&workers[started].thread, NULL, relay_worker,
+                             &workers[started]);
+        if (err != 0) {
+            relay_stop(0);
+            break;
+        }
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        err = err != 0 ? err : workers[i].err;
+    }
+    if (err != 0) {
+        errno = err;
+        goto out;
+    }
+    ret = 0;
+
+out:;
+    int saved_errno = errno;
+    if (wake_fd >= 0) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    // Connections still open, and the pool they use, are released by process
+    // exit
+    if (started == 0) {
+        pool_destroy(&shared.pool);
+    }
+    relay_free_addresses(shared.listen_ai);
+    relay_free_addresses(shared.forward_ai);
+    free(workers);
+    errno = saved_errno;
+    return ret;
+}
@@ -0,0 +1,43 @@
+/**
+ * @file relay.h
+ * TCP relay crypting the traffic between its clients and a forward address.
+ */
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "caesar.h"
+
+#include <stddef.h>
+
+/**
+ * @brief Relay TCP connections to another address until interrupted
+ *
+ * Every connection accepted on the listening address is paired with a new
+ * connection to the forward address. Bytes from the client are crypted with
+ * up before being forwarded, and bytes back from the forward address with
+ * down, usually the inverse key, so a client speaking plain text can talk to
+ * a service expecting the cipher text or the other way around. Each direction
+ * is crypted as a stream of its own, so keyword keys work as usual.
+ *
+ * Each worker thread has its own epoll instance and listening socket, bound
+ * with SO_REUSEPORT so the kernel spreads connections over the workers, and
+ * serves all of its connections without blocking. Large sends go out with
+ * MSG_ZEROCOPY where the kernel supports it.
+ *
+ * When built with RELAY_NUMERIC_HOSTS, as caesar-static is, hosts and ports
+ * must be numeric, as they are parsed without getaddrinfo().
+ *
+ * The relay runs until it receives SIGINT or SIGTERM.
+ *
+ * @param up        Key crypting bytes from clients to the forward address
+ * @param down      Key crypting bytes from the forward address to clients
+ * @param listen    Address to listen on, as [host:]port. The port may not be
+ *                  0, as every worker must bind the same one.
+ * @param forward   Address to forward to, as host:port
+ * @param nthreads  Number of worker threads
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int relay(const struct caesar_key *up, const struct caesar_key *down,
+          const char *listen, const char *forward, size_t nthreads);
+
+#endif
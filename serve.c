@@ -0,0 +1,596 @@
+/**
+ * @file serve.c
+ * Server crypting length-prefixed requests over a Unix domain socket.
+ */
+#define _GNU_SOURCE
+#include "serve.h"
+
+#include "pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/** Size of the length prefix of every frame */
+#define FRAME_HEADER 4
+
+/** Number of epoll events handled per wakeup */
+#define SERVE_MAX_EVENTS 256
+
+/** Milliseconds new connections wait after accept() fails unexpectedly */
+#define SERVE_ACCEPT_BACKOFF_MS 100
+
+/** Number of bytes read from a connection at a time */
+#define SERVE_READ_SIZE (64 * 1024)
+
+/**
+ * Number of received bytes past which a connection is not read until its
+ * complete requests are crypted. An incomplete request is always shorter, so
+ * a connection stopped there has at least one complete request.
+ */
+#define SERVE_MAX_BUFFERED (FRAME_HEADER + SERVE_MAX_FRAME)
+
+/**
+ * Number of unsent answer bytes past which no more requests are taken from a
+ * connection, until its peer reads enough of them
+ */
+#define SERVE_MAX_PENDING (FRAME_HEADER + SERVE_MAX_FRAME)
+
+/**
+ * Size of the pooled buffers connections receive into and answer from, room
+ * for a read on top of a partial request. Larger buffers come from the heap.
+ */
+#define SERVE_POOL_BUF_SIZE (2 * SERVE_READ_SIZE)
+
+/** Number of pooled buffers, beyond which connections use the heap */
+#define SERVE_POOL_BUFS 256
+
+/** Growable byte buffer */
+struct buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * @brief Make room for more bytes at the end of a buffer
+ *
+ * An empty buffer takes one from the pool if it is large enough and one is
+ * free. A buffer outgrowing its pooled one moves to the heap.
+ *
+ * @param pool  Pool of buffers
+ * @param buf   Buffer to grow
+ * @param extra Number of bytes needed past the current length
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int buf_reserve(struct pool *pool, struct buf *buf, size_t extra)
+{
+    if (buf->cap - buf->len >= extra) {
+        return 0;
+    }
+    if (buf->cap == 0 && extra <= pool->buf_size) {
+        buf->data = pool_get(pool, 0);
+        if (buf->data != NULL) {
+            buf->cap = pool->buf_size;
+            return 0;
+        }
+    }
+
+    size_t cap = buf->cap > 0 ? buf->cap : SERVE_READ_SIZE;
+    while (cap - buf->len < extra) {
+        cap *= 2;
+    }
+    uint8_t *data;
+    if (pool_owns(pool, buf->data)) {
+        data = malloc(cap);
+        if (data == NULL) {
+            return -1;
+        }
+        memcpy(data, buf->data, buf->len);
+        pool_put(pool, buf->data);
+    } else {
+        data = realloc(buf->data, cap);
+        if (data == NULL) {
+            return -1;
+        }
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+/**
+ * @brief Give an empty buffer's memory back to the pool or the heap
+ * @param pool  Pool of buffers
+ * @param buf   Buffer to release
+ */
+static void buf_release(struct pool *pool, struct buf *buf)
+{
+    if (pool_owns(pool, buf->data)) {
+        pool_put(pool, buf->data);
+    } else {
+        free(buf->data);
+    }
+    *buf = (struct buf){0};
+}
+
+/** Client connection */
+struct conn {
+    int fd;
+    struct buf in;   /**< Received bytes not yet taken as requests */
+    size_t scanned;  /**< Bytes at the start of in that are full requests */
+    struct buf out;  /**< Answers not yet sent */
+    size_t out_sent; /**< Bytes at the start of out already sent */
+    bool ready;      /**< Whether the connection is on the ready list */
+    bool eof;        /**< Whether the peer has stopped sending */
+    bool more;       /**< Whether reading stopped before the socket was empty */
+    bool failed;     /**< Whether memory for its answers ran out */
+    struct conn *next_ready;
+};
+
+/** Request taken from a connection into the current batch */
+struct batch_entry {
+    struct conn *conn;
+    size_t off; /**< Offset of the payload in the batch */
+    size_t len;
+};
+
+/** Set by the signal handler to stop the server */
+static volatile sig_atomic_t stop;
+
+/**
+ * @brief Signal handler asking the server to stop
+ * @param sig   Signal number
+ */
+static void serve_stop(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+/**
+ * @brief Close a connection and release its buffers
+ * @param pool  Pool of buffers
+ * @param conn  Connection to close
+ */
+static void conn_close(struct pool *pool, struct conn *conn)
+{
+    close(conn->fd);
+    buf_release(pool, &conn->in);
+    buf_release(pool, &conn->out);
+    free(conn);
+}
+
+/**
+ * @brief Number of answer bytes of a connection not yet sent
+ * @param conn  Connection
+ * @return Number of bytes
+ */
+static size_t conn_pending(const struct conn *conn)
+{
+    return conn->out.len - conn->out_sent;
+}
+
+/**
+ * @brief Send as much of a connection's pending answers as the socket takes
+ *
+ * Once everything is sent, the answer buffer is released, so idle connections
+ * hold no buffers.
+ *
+ * @param pool  Pool of buffers
+ * @param conn  Connection to flush
+ * @return 0 on success, or -1 if the connection failed
+ */
+static int conn_flush(struct pool *pool, struct conn *conn)
+{
+    while (conn->out_sent < conn->out.len) {
+        ssize_t sent = send(conn->fd, conn->out.data + conn->out_sent,
+                            conn->out.len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        conn->out_sent += sent;
+    }
+
+    buf_release(pool, &conn->out);
+    conn->out_sent = 0;
+    return 0;
+}
+
+/**
+ * @brief Decode a frame's length prefix
+ * @param p Start of the frame
+ * @return Payload length
+ */
+static size_t frame_len(const uint8_t *p)
+{
+    return (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+}
+
+/**
+ * @brief Read everything available on a connection, up to SERVE_MAX_BUFFERED
+ *
+ * Each request's length is checked as soon as its prefix arrives, and nothing
+ * past a request longer than SERVE_MAX_FRAME is read. If reading stops at
+ * SERVE_MAX_BUFFERED, conn->more is set.
+ *
+ * @param pool  Pool of buffers
+ * @param conn  Connection to read from
+ * @return 1 if the connection is still open, 0 if the peer closed it or sent
+ *         a request too large, or -1 if it failed
+ */
+static int conn_fill(struct pool *pool, struct conn *conn)
+{
+    conn->more = false;
+    for (;;) {
+        if (conn->in.len >= SERVE_MAX_BUFFERED) {
+            conn->more = true;
+            return 1;
+        }
+        if (buf_reserve(pool, &conn->in, SERVE_READ_SIZE) < 0) {
+            return -1;
+        }
+        ssize_t got = recv(conn->fd, conn->in.data + conn->in.len,
+                           conn->in.cap - conn->in.len, 0);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        if (got == 0) {
+            return 0;
+        }
+        conn->in.len += got;
+
+        while (conn->in.len - conn->scanned >= FRAME_HEADER) {
+            size_t len = frame_len(conn->in.data + conn->scanned);
+            if (len > SERVE_MAX_FRAME) {
+                return 0;
+            }
+            if (conn->in.len - conn->scanned - FRAME_HEADER < len) {
+                break;
+            }
+            conn->scanned += FRAME_HEADER + len;
+        }
+    }
+}
+
+/**
+ * @brief Create the listening socket, replacing a stale one at the path
+ * @param path  Path of the socket
+ * @return Socket descriptor, or -1 on failure with errno set
+ */
+static int serve_listen(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Accept every pending connection and add it to the epoll instance
+ *
+ * The listening socket is level-triggered, so a connection left pending would
+ * wake the server again at once. When out of descriptors, the spare one is
+ * given up to accept the client and close it. On any other failure, the
+ * listening socket is taken out of the epoll instance for a while.
+ *
+ * @param epoll_fd  Epoll instance
+ * @param listen_fd Listening socket
+ * @param spare_fd  Spare descriptor, or -1 if it could not be opened again
+ * @return Whether the listening socket is still watched
+ */
+static bool serve_accept(int epoll_fd, int listen_fd, int *spare_fd)
+{
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && *spare_fd >= 0) {
+                close(*spare_fd);
+                fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd >= 0) {
+                    close(fd);
+                }
+                *spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (fd >= 0) {
+                    continue;
+                }
+            }
+            struct epoll_event ev = {.events = 0, .data.ptr = NULL};
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev);
+            return false;
+        }
+
+        struct conn *accepted = calloc(1, sizeof(*accepted));
+        struct epoll_event conn_ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLET,
+            .data.ptr = accepted,
+        };
+        if (accepted == NULL ||
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &conn_ev) < 0) {
+            free(accepted);
+            close(fd);
+            continue;
+        }
+        accepted->fd = fd;
+    }
+}
+
+/**
+ * @brief Crypt every complete request of the ready connections in one batch
+ *
+ * The payloads are gathered into the batch buffer, crypted with a single call
+ * and then appended to each connection's answers. Requests are only taken
+ * from a connection while its unsent answers stay below SERVE_MAX_PENDING,
+ * and room for their answers is made before they are taken. A connection
+ * for which memory runs out is marked failed and left for the caller to
+ * close, so it does not affect the others.
+ *
+ * @param key       Prepared key to crypt with
+ * @param pool      Pool of buffers
+ * @param ready     List of connections that received data
+ * @param batch     Batch buffer, reused between calls
+ * @param entries   Entry array, reused between calls
+ * @param nentries  Capacity of the entry array, updated if it grows
+ */
+static void serve_batch(const struct caesar_key *key, struct pool *pool,
+                       struct conn *ready, struct buf *batch,
+                       struct batch_entry **entries, size_t *nentries)
+{
+    size_t count = 0;
+    batch->len = 0;
+
+    for (struct conn *conn = ready; conn != NULL; conn = conn->next_ready) {
+        if (conn->out_sent > 0 && conn->scanned > 0) {
+            // Drop the answers already sent, so out stays within bounds too
+            memmove(conn->out.data, conn->out.data + conn->out_sent,
+                    conn_pending(conn));
+            conn->out.len -= conn->out_sent;
+            conn->out_sent = 0;
+        }
+
+        size_t off = 0;
+        while (!conn->failed && off < conn->scanned &&
+               conn_pending(conn) + off < SERVE_MAX_PENDING) {
+            size_t len = frame_len(conn->in.data + off);
+            if (count == *nentries) {
+                size_t n = *nentries > 0 ? *nentries * 2 : SERVE_MAX_EVENTS;
+                struct batch_entry *grown =
+                    realloc(*entries, n * sizeof(**entries));
+                if (grown == NULL) {
+                    conn->failed = true;
+                    break;
+                }
+                *entries = grown;
+                *nentries = n;
+            }
+            // Answers are as long as the requests taken so far
+            if (buf_reserve(pool, batch, len) < 0 ||
+                buf_reserve(pool, &conn->out, off + FRAME_HEADER + len) < 0) {
+                conn->failed = true;
+                break;
+            }
+
+            memcpy(batch->data + batch->len,
+                   conn->in.data + off + FRAME_HEADER, len);
+            (*entries)[count++] = (struct batch_entry){conn, batch->len, len};
+            batch->len += len;
+            off += FRAME_HEADER + len;
+        }
+
+        // Keep only the incomplete tail for the next round
+        memmove(conn->in.data, conn->in.data + off, conn->in.len - off);
+        conn->in.len -= off;
+        conn->scanned -= off;
+        if (conn->in.len == 0) {
+            buf_release(pool, &conn->in);
+        }
+    }
+
+    caesar_transform_inplace(key, batch->data, batch->len);
+
+    for (size_t i = 0; i < count; i++) {
+        struct batch_entry *entry = &(*entries)[i];
+        struct buf *out = &entry->conn->out;
+        uint8_t *p = out->data + out->len;
+        p[0] = entry->len >> 24;
+        p[1] = entry->len >> 16;
+        p[2] = entry->len >> 8;
+        p[3] = entry->len;
+        memcpy(p + FRAME_HEADER, batch->data + entry->off, entry->len);
+        out->len += FRAME_HEADER + entry->len;
+    }
+}
+
+int serve(const struct caesar_key *key, const char *path)
+{
+    struct sigaction sa = {.sa_handler = serve_stop};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    struct pool pool;
+    if (pool_init(&pool, SERVE_POOL_BUF_SIZE, SERVE_POOL_BUFS, 1) < 0) {
+        return -1;
+    }
+    int listen_fd = serve_listen(path);
+    if (listen_fd < 0) {
+        int saved_errno = errno;
+        pool_destroy(&pool);
+        errno = saved_errno;
+        return -1;
+    }
+
+    // Held so that a client can still be accepted, and turned away, once the
+    // process runs out of descriptors
+    int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int ret = -1;
+    struct buf batch = {0};
+    struct batch_entry *entries = NULL;
+    size_t nentries = 0;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_fd < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        goto out;
+    }
+
+    // Connections that stopped reading early stay ready for the next round
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    struct conn *ready = NULL;
+    bool accepting = true;
+    while (!stop) {
+        int timeout = ready != NULL ? 0 : accepting ? -1
+                                                    : SERVE_ACCEPT_BACKOFF_MS;
+        int n = epoll_wait(epoll_fd, events, SERVE_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            goto out;
+        }
+        if (!accepting) {
+            ev.events = EPOLLIN;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev);
+            accepting = true;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct conn *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accepting = serve_accept(epoll_fd, listen_fd, &spare_fd);
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT && conn_flush(&pool, conn) < 0) {
+                events[i].events |= EPOLLERR;
+            }
+            int open = 1;
+            if (!conn->eof &&
+                events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                open = conn_fill(&pool, conn);
+            }
+            if (open < 0 || events[i].events & EPOLLERR) {
+                // The connection goes away with any requests it still had
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+                if (conn->ready) {
+                    // Unlink it from the ready list before freeing it
+                    struct conn **link = &ready;
+                    while (*link != conn) {
+                        link = &(*link)->next_ready;
+                    }
+                    *link = conn->next_ready;
+                }
+                conn_close(&pool, conn);
+                continue;
+            }
+            // Requests sent before the peer shut down, or before one too large,
+            // are still answered
+            conn->eof |= open == 0;
+            if (!conn->ready) {
+                conn->ready = true;
+                conn->next_ready = ready;
+                ready = conn;
+            }
+        }
+
+        serve_batch(key, &pool, ready, &batch, &entries, &nentries);
+
+        struct conn *again = NULL;
+        while (ready != NULL) {
+            struct conn *conn = ready;
+            ready = conn->next_ready;
+            conn->ready = false;
+            conn->next_ready = NULL;
+
+            // Once a peer that stopped sending has every answer, anything left
+            // is an incomplete request
+            if (conn->failed || conn_flush(&pool, conn) < 0 ||
+                (conn->eof && conn->scanned == 0 && conn->out.len == 0)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+                conn_close(&pool, conn);
+                continue;
+            }
+            if (conn_pending(conn) >= SERVE_MAX_PENDING) {
+                // The socket is full, so EPOLLOUT brings it back once the peer
+                // reads its answers
+                continue;
+            }
+
+            // Edge-triggered epoll will not report what is left unread
+            if (conn->more && !conn->eof) {
+                int open = conn_fill(&pool, conn);
+                if (open < 0) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    conn_close(&pool, conn);
+                    continue;
+                }
+                conn->eof |= open == 0;
+            }
+            if (conn->scanned > 0 || (conn->eof && conn->out.len == 0)) {
+                conn->ready = true;
+                conn->next_ready = again;
+                again = conn;
+            }
+        }
+        ready = again;
+    }
+    ret = 0;
+
+out:;
+    int saved_errno = errno;
+    // Connections still open, and the pool they use, are released by process
+    // exit
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+    close(listen_fd);
+    if (spare_fd >= 0) {
+        close(spare_fd);
+    }
+    unlink(path);
+    buf_release(&pool, &batch);
+    free(entries);
+    errno = saved_errno;
+    return ret;
+}
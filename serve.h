@@ -0,0 +1,34 @@
+/**
+ * @file serve.h
+ * Server crypting length-prefixed requests over a Unix domain socket.
+ */
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "caesar.h"
+
+/** Largest request payload accepted by serve() */
+#define SERVE_MAX_FRAME (16 * 1024 * 1024)
+
+/**
+ * @brief Serve crypt requests on a Unix domain socket until interrupted
+ *
+ * Each request is a 4-byte big-endian payload length followed by the payload,
+ * and is answered with a frame of the same form holding the crypted payload.
+ * A connection may send any number of requests, and answers are sent in
+ * request order. All requests that arrive together, across all connections,
+ * are crypted with a single caesar_transform_inplace() call. A request longer
+ * than SERVE_MAX_FRAME ends its connection once the requests before it are
+ * answered, and nothing past its length prefix is read.
+ *
+ * The server runs until it receives SIGINT or SIGTERM, then removes the
+ * socket.
+ *
+ * @param key   Prepared key to crypt with
+ * @param path  Path of the socket to listen on. A stale socket at that path
+ *              is replaced.
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int serve(const struct caesar_key *key, const char *path);
+
+#endif
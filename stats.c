@@ -0,0 +1,145 @@
+/**
+ * @file stats.c
+ * Throughput, timing and hardware counters reported by --stats.
+ */
+#define _GNU_SOURCE
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+struct stats *stats;
+
+/** Hardware counters reported by --stats */
+enum stats_counter {
+    sc_cycles,
+    sc_instructions,
+    sc_cache_misses,
+    sc_branch_misses,
+    sc_count,
+};
+
+/** Name of each hardware counter in the report */
+static const char *const COUNTER_NAMES[sc_count] = {
+    [sc_cycles] = "cycles",
+    [sc_instructions] = "instructions",
+    [sc_cache_misses] = "cache_misses",
+    [sc_branch_misses] = "branch_misses",
+};
+
+/** Counters collected since stats_start() */
+static struct stats totals;
+
+/** File descriptor of each hardware counter, or -1 if unavailable */
+static int counter_fds[sc_count];
+
+/** stats_clock() when stats_start() was called */
+static uint64_t start_ns;
+
+/**
+ * @brief Open a hardware counter for this thread and its future threads
+ * @param config    PERF_COUNT_HW_* event to count
+ * @return File descriptor of the counter, or -1 if unavailable
+ */
+static int counter_open(unsigned long long config)
+{
+#ifdef __linux__
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = config,
+        .disabled = 1,
+        .inherit = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return fd;
+#else
+    (void)config;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Print the report, called at exit
+ */
+static void stats_report(void)
+{
+    uint64_t wall_ns = stats_clock() - start_ns;
+
+    // Stop every counter before reading any, so they cover the same span
+    long long values[sc_count];
+    bool valid[sc_count];
+#ifdef __linux__
+    for (int i = 0; i < sc_count; i++) {
+        if (counter_fds[i] >= 0) {
+            ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+#endif
+    for (int i = 0; i < sc_count; i++) {
+        valid[i] = counter_fds[i] >= 0 &&
+                   read(counter_fds[i], &values[i], sizeof(values[i])) ==
+                       sizeof(values[i]);
+    }
+
+    fprintf(stderr,
+            "{\"bytes_read\":%llu,\"bytes_written\":%llu,\"reads\":%llu,"
+            "\"writes\":%llu,\"wall_s\":%.6f,\"read_s\":%.6f,"
+            "\"transform_s\":%.6f,\"write_s\":%.6f,\"gbps\":%.3f,"
+            "\"pool_high_water\":%llu,\"pool_exhausted\":%llu,"
+            "\"timed_flushes\":%llu",
+            (unsigned long long)stats->bytes_read,
+            (unsigned long long)stats->bytes_written,
+            (unsigned long long)stats->reads,
+            (unsigned long long)stats->writes, wall_ns / 1e9,
+            stats->read_ns / 1e9, stats->transform_ns / 1e9,
+            stats->write_ns / 1e9,
+            wall_ns > 0 ? (double)stats->bytes_read / wall_ns : 0,
+            (unsigned long long)stats->pool_high_water,
+            (unsigned long long)stats->pool_exhausted,
+            (unsigned long long)stats->timed_flushes);
+    for (int i = 0; i < sc_count; i++) {
+        if (valid[i]) {
+            fprintf(stderr, ",\"%s\":%lld", COUNTER_NAMES[i], values[i]);
+        } else {
+            fprintf(stderr, ",\"%s\":null", COUNTER_NAMES[i]);
+        }
+    }
+    if (valid[sc_cycles] && valid[sc_instructions] && values[sc_cycles] > 0) {
+        fprintf(stderr, ",\"ipc\":%.3f",
+                (double)values[sc_instructions] / values[sc_cycles]);
+    }
+    fprintf(stderr, "}\n");
+}
+
+void stats_start(void)
+{
+    static const unsigned long long configs[sc_count] = {
+#ifdef __linux__
+        [sc_cycles] = PERF_COUNT_HW_CPU_CYCLES,
+        [sc_instructions] = PERF_COUNT_HW_INSTRUCTIONS,
+        [sc_cache_misses] = PERF_COUNT_HW_CACHE_MISSES,
+        [sc_branch_misses] = PERF_COUNT_HW_BRANCH_MISSES,
+#endif
+    };
+
+    stats = &totals;
+    start_ns = stats_clock();
+    for (int i = 0; i < sc_count; i++) {
+        counter_fds[i] = counter_open(configs[i]);
+    }
+    atexit(stats_report);
+}
@@ -0,0 +1,101 @@
+/**
+ * @file stats.h
+ * Throughput, timing and hardware counters reported by --stats.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Counters updated by the stream engines while --stats is on. Any thread may
+ * add to them with stats_add().
+ */
+struct stats {
+    uint64_t bytes_read;      /**< Bytes read from the input */
+    uint64_t bytes_written;   /**< Bytes written to the output */
+    uint64_t reads;           /**< Read operations, system calls or io_uring */
+    uint64_t writes;          /**< Write operations, system calls or io_uring */
+    uint64_t read_ns;         /**< Time spent in blocking reads */
+    uint64_t transform_ns;    /**< Time spent crypting, summed over threads */
+    uint64_t write_ns;        /**< Time spent in blocking writes */
+    uint64_t pool_high_water; /**< Most buffers in use at once in any pool */
+    uint64_t pool_exhausted;  /**< Times a pool had no free buffer */
+    uint64_t timed_flushes;   /**< Unfinished lines flushed by --flush-us */
+};
+
+/** Counters being collected, or NULL if --stats is off */
+extern struct stats *stats;
+
+/**
+ * @brief Read the clock used to time operations for --stats
+ * @return Monotonic time in nanoseconds, or 0 if --stats is off
+ */
+static inline uint64_t stats_clock(void)
+{
+    if (stats == NULL) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Add to a counter from any thread
+ * @param counter   Field of *stats to add to
+ * @param value     Amount to add
+ */
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Raise a counter to a value from any thread, if it is lower
+ * @param counter   Field of *stats to raise
+ * @param value     Value to raise it to
+ */
+static inline void stats_max(uint64_t *counter, uint64_t value)
+{
+    uint64_t old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (old < value &&
+           !__atomic_compare_exchange_n(counter, &old, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * @brief Account one read or write operation to --stats
+ * @param calls Counter of operations
+ * @param ns    Counter of time spent, or NULL if not timed
+ * @param bytes Counter of bytes transferred
+ * @param start stats_clock() when the operation started
+ * @param len   Result of the operation, negative on failure
+ */
+static inline void stats_io(uint64_t *calls, uint64_t *ns, uint64_t *bytes,
+                            uint64_t start, long len)
+{
+    stats_add(calls, 1);
+    if (ns != NULL) {
+        stats_add(ns, stats_clock() - start);
+    }
+    if (len > 0) {
+        stats_add(bytes, len);
+    }
+}
+
+/**
+ * @brief Turn on --stats and start the hardware counters
+ *
+ * Cycles, instructions, cache misses and branch mispredictions are counted in
+ * user space for this thread and every thread it creates from now on, using
+ * perf_event_open(2) if the kernel allows it. The counters only run in the
+ * PMU, so they cost nothing while crypting. The report is printed to stderr
+ * as a single JSON object when the program exits.
+ */
+void stats_start(void);
+
+#endif
@@ -0,0 +1,1530 @@
+/**
+ * @file stream.c
+ * Stream engines crypting input from file descriptors.
+ */
+#define _GNU_SOURCE
+#include "stream.h"
+
+#include "numa.h"
+#include "pool.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/** Size of the compressed buffers of crypt_stream_compressed() */
+#define COMPRESSED_BUF_SIZE (128 * 1024)
+
+/** Pipe size requested for the output pipe by crypt_stream_splice() */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+/**
+ * @brief Call read(2), accounting it to --stats
+ * @param fd    File descriptor to read from
+ * @param buf   Buffer to read into
+ * @param len   Size of the buffer
+ * @return Result of read(2)
+ */
+static ssize_t counted_read(int fd, void *buf, size_t len)
+{
+    uint64_t start = stats_clock();
+    ssize_t got = read(fd, buf, len);
+    if (stats != NULL) {
+        stats_io(&stats->reads, &stats->read_ns, &stats->bytes_read, start,
+                 got);
+    }
+    return got;
+}
+
+/**
+ * @brief Crypt part of a stream in place, accounting it to --stats
+ * @param key   Prepared key
+ * @param pos   Offset in the stream of the first byte
+ * @param buf   Bytes to crypt
+ * @param len   Number of bytes to crypt
+ */
+static void crypt_at(const struct caesar_key *key, uint64_t pos, char *buf,
+                     size_t len)
+{
+    uint64_t start = stats_clock();
+    caesar_transform_inplace_at(key, pos, (uint8_t *)buf, len);
+    if (stats != NULL) {
+        stats_add(&stats->transform_ns, stats_clock() - start);
+    }
+}
+
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        uint64_t start = stats_clock();
+        ssize_t written = write(fd, buf, len);
+        if (stats != NULL) {
+            stats_io(&stats->writes, &stats->write_ns, &stats->bytes_written,
+                     start, written);
+        }
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Number of block buffers kept in flight by crypt_stream_uring(). Must be a
+ * power of two, as it doubles as the write flag in completion user data.
+ */
+#define URING_NBUFS 8
+
+/** Minimal io_uring instance driven through the raw system calls */
+struct uring {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit; /**< Number of queued SQEs not yet submitted */
+};
+
+/**
+ * @brief Set up an io_uring instance and map its rings
+ * @param ring      Instance to set up
+ * @param entries   Number of submission queue entries
+ * @return 0 on success, or -1 on failure with errno set. errno is ENOSYS if
+ *         the kernel lacks the features crypt_stream_uring() relies on.
+ */
+static int uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params = {0};
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    // Reads and writes at the current file position need Linux 5.6
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+        ring->sqes == MAP_FAILED) {
+        int saved_errno = errno;
+        if (ring->sq_ring != MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        if (ring->cq_ring != MAP_FAILED) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        close(ring->fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * @brief Release an io_uring instance set up by uring_init()
+ * @param ring  Instance to release
+ */
+static void uring_destroy(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/**
+ * @brief Queue a read or write on an io_uring instance
+ *
+ * The caller must never have more operations outstanding than the ring has
+ * submission entries.
+ *
+ * @param ring      Instance to queue on
+ * @param opcode    IORING_OP_READ(_FIXED) or IORING_OP_WRITE(_FIXED)
+ * @param fd        File descriptor to operate on
+ * @param buf       Buffer to read into or write from
+ * @param len       Number of bytes to transfer
+ * @param off       File offset, or -1 for the current file position
+ * @param buf_index Index of the registered buffer for the _FIXED opcodes
+ * @param user_data Value returned in the completion
+ */
+static void uring_queue(struct uring *ring, int opcode, int fd, char *buf,
+                        size_t len, off_t off, unsigned buf_index,
+                        uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+/**
+ * @brief Submit queued operations and wait for at least one completion
+ * @param ring  Instance to submit on
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int uring_submit_and_wait(struct uring *ring)
+{
+    for (;;) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) {
+            ring->to_submit -= ret;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/** State of a block buffer in crypt_stream_uring() */
+enum uring_buf_state {
+    ubs_free,    /**< No operation pending */
+    ubs_reading, /**< Read in flight */
+    ubs_ready,   /**< Crypted, waiting for its turn to be written */
+    ubs_writing, /**< Write in flight */
+};
+
+/** Block buffer of crypt_stream_uring() */
+struct uring_buf {
+    char *data;
+    size_t filled;  /**< Bytes read into the buffer so far */
+    size_t written; /**< Bytes of the buffer written so far */
+    enum uring_buf_state state;
+};
+
+/**
+ * @brief Crypt a stream using io_uring for the reads and writes
+ *
+ * Several block buffers are kept in flight, so that crypting one block
+ * overlaps with reading the following blocks and writing the previous one.
+ * Block n lives in buffer n % URING_NBUFS, and writes are issued one at a
+ * time in block order. Several reads are only issued at once when the input
+ * is a regular file, where each read can be given an explicit offset.
+ *
+ * @param key           Prepared key
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param block_size    Size in bytes of each block buffer
+ * @return 0 on success, 1 if io_uring is unavailable and nothing has been
+ *         read, or -1 on failure with errno set
+ */
+static int crypt_stream_uring(const struct caesar_key *key, int in_fd,
+                              int out_fd, size_t block_size)
+{
+    struct uring ring;
+    if (uring_init(&ring, URING_NBUFS + 1) < 0) {
+        return 1;
+    }
+
+    struct stat st;
+    off_t in_base = lseek(in_fd, 0, SEEK_CUR);
+    bool seekable =
+        fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode) && in_base >= 0;
+
+    int ret = -1;
+    struct uring_buf bufs[URING_NBUFS] = {0};
+    struct iovec iovs[URING_NBUFS];
+    for (size_t i = 0; i < URING_NBUFS; i++) {
+        errno = posix_memalign((void **)&bufs[i].data, sysconf(_SC_PAGESIZE),
+                               block_size);
+        if (errno != 0) {
+            goto out;
+        }
+        iovs[i].iov_base = bufs[i].data;
+        iovs[i].iov_len = block_size;
+    }
+
+    // Registered buffers save a page pinning per operation, but registering
+    // can fail with a low RLIMIT_MEMLOCK, so plain operations are the fallback
+    bool fixed = syscall(__NR_io_uring_register, ring.fd,
+                         IORING_REGISTER_BUFFERS, iovs, URING_NBUFS) == 0;
+    int read_op = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    int write_op = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+
+    size_t nread = 0;    // Blocks whose read has been issued
+    size_t nwritten = 0; // Blocks written out completely
+    uint64_t pos = 0;    // Bytes read so far, if reads complete in order
+    size_t eof = SIZE_MAX; // First block found to be empty
+    size_t inflight = 0;
+    size_t reads_inflight = 0;
+    bool write_inflight = false;
+    int err = 0;
+
+    for (;;) {
+        while (err == 0 && eof == SIZE_MAX && nread - nwritten < URING_NBUFS &&
+               (seekable || reads_inflight == 0)) {
+            size_t i = nread % URING_NBUFS;
+            bufs[i].filled = 0;
+            bufs[i].written = 0;
+            bufs[i].state = ubs_reading;
+            off_t off = seekable ? in_base + (off_t)(nread * block_size) : -1;
+            uring_queue(&ring, read_op, in_fd, bufs[i].data, block_size, off,
+                        i, i);
+            nread++;
+            reads_inflight++;
+            inflight++;
+        }
+
+        struct uring_buf *next = &bufs[nwritten % URING_NBUFS];
+        if (err == 0 && !write_inflight && nwritten < nread &&
+            next->state == ubs_ready) {
+            next->state = ubs_writing;
+            uring_queue(&ring, write_op, out_fd, next->data + next->written,
+                        next->filled - next->written, -1,
+                        nwritten % URING_NBUFS,
+                        (nwritten % URING_NBUFS) | URING_NBUFS);
+            write_inflight = true;
+            inflight++;
+        }
+
+        if (inflight == 0) {
+            break;
+        }
+
+        if (uring_submit_and_wait(&ring) < 0) {
+            // Nothing was submitted, so no operation can complete
+            err = errno;
+            break;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            size_t i = cqe->user_data & (URING_NBUFS - 1);
+            struct uring_buf *buf = &bufs[i];
+            bool is_write = cqe->user_data & URING_NBUFS;
+            int res = cqe->res;
+            inflight--;
+
+            // Operations overlap, so only their number and size are counted
+            if (stats != NULL) {
+                stats_io(is_write ? &stats->writes : &stats->reads, NULL,
+                         is_write ? &stats->bytes_written : &stats->bytes_read,
+                         0, res);
+            }
+
+            if (is_write) {
+                write_inflight = false;
+                if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                    err = err != 0 ? err : -res;
+                    continue;
+                }
+                buf->written += res > 0 ? res : 0;
+                buf->state = ubs_ready;
+                if (buf->written == buf->filled) {
+                    buf->state = ubs_free;
+                    nwritten++;
+                }
+                continue;
+            }
+
+            reads_inflight--;
+            if (res < 0 && res != -EINTR && res != -EAGAIN) {
+                err = err != 0 ? err : -res;
+                continue;
+            }
+
+            // Block number of this buffer among those in flight
+            size_t block = nwritten + (i + URING_NBUFS -
+                                       nwritten % URING_NBUFS) %
+                                          URING_NBUFS;
+            if (res == 0 && buf->filled == 0) {
+                eof = block < eof ? block : eof;
+                buf->state = ubs_free;
+                continue;
+            }
+            if (res > 0) {
+                // Reads of a pipe complete in order but may be short, while
+                // blocks of a regular file are full up to the end
+                uint64_t at = seekable ? block * block_size + buf->filled : pos;
+                crypt_at(key, at, buf->data + buf->filled, res);
+                buf->filled += res;
+                pos += res;
+            }
+
+            if (seekable && res != 0 && buf->filled < block_size) {
+                // A short read of a regular file can only be retried in
+                // place, since later blocks are read at fixed offsets.
+                off_t off = in_base + (off_t)(block * block_size +
+                                              buf->filled);
+                uring_queue(&ring, read_op, in_fd, buf->data + buf->filled,
+                            block_size - buf->filled, off, i, i);
+                reads_inflight++;
+                inflight++;
+                continue;
+            }
+            buf->state = ubs_ready;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        // Blocks past the end of the input never get written
+        if (eof != SIZE_MAX && nwritten == eof) {
+            nread = nwritten;
+        }
+    }
+
+    if (err == 0) {
+        ret = 0;
+    } else {
+        errno = err;
+    }
+
+out:;
+    int saved_errno = errno;
+    // Tear the ring down first so that no operation can touch the buffers
+    uring_destroy(&ring);
+    for (size_t i = 0; i < URING_NBUFS; i++) {
+        free(bufs[i].data);
+    }
+    errno = saved_errno;
+    return ret;
+}
+#endif
+
+bool stream_uring_supported(void)
+{
+#ifdef HAVE_IO_URING
+    struct uring ring;
+    if (uring_init(&ring, URING_NBUFS + 1) < 0) {
+        return false;
+    }
+    uring_destroy(&ring);
+    return true;
+#else
+    return false;
+#endif
+}
+
+int crypt_stream(const struct caesar_key *key, int in_fd, int out_fd,
+                 size_t block_size)
+{
+#ifdef HAVE_IO_URING
+    int uring_ret = crypt_stream_uring(key, in_fd, out_fd, block_size);
+    if (uring_ret <= 0) {
+        return uring_ret;
+    }
+#endif
+
+    char *buf = malloc(block_size);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t pos = 0;
+    for (;;) {
+        ssize_t len = counted_read(in_fd, buf, block_size);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -1;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        crypt_at(key, pos, buf, len);
+        pos += len;
+
+        if (write_all(out_fd, buf, len) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    int saved_errno = errno;
+    free(buf);
+    errno = saved_errno;
+    return ret;
+}
+
+/**
+ * @brief Read the monotonic clock
+ * @return Monotonic time in microseconds
+ */
+static uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int crypt_stream_lines(const struct caesar_key *key, int in_fd, int out_fd,
+                       size_t block_size, uint64_t flush_us)
+{
+    char *buf = malloc(block_size);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t pos = 0;
+    size_t pending = 0;    // Crypted bytes of an unfinished line
+    uint64_t deadline = 0; // When the pending bytes are flushed regardless
+    for (;;) {
+        // Only wait for input with a time bound while a line is pending
+        struct timespec timeout;
+        struct timespec *wait = NULL;
+        if (pending > 0 && flush_us > 0) {
+            uint64_t now = monotonic_us();
+            uint64_t left = deadline > now ? deadline - now : 0;
+            timeout.tv_sec = left / 1000000;
+            timeout.tv_nsec = left % 1000000 * 1000;
+            wait = &timeout;
+        }
+        struct pollfd pfd = {.fd = in_fd, .events = POLLIN};
+        int ready = ppoll(&pfd, 1, wait, NULL);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -1;
+            break;
+        }
+        if (ready == 0) {
+            if (stats != NULL) {
+                stats_add(&stats->timed_flushes, 1);
+            }
+            if (write_all(out_fd, buf, pending) < 0) {
+                ret = -1;
+                break;
+            }
+            pending = 0;
+            continue;
+        }
+
+        ssize_t len = counted_read(in_fd, buf + pending, block_size - pending);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -1;
+            break;
+        }
+        if (len == 0) {
+            ret = write_all(out_fd, buf, pending);
+            break;
+        }
+
+        // Everything read is crypted at once, however many lines it holds
+        crypt_at(key, pos, buf + pending, len);
+        pos += len;
+        if (pending == 0) {
+            deadline = monotonic_us() + flush_us;
+        }
+
+        const char *newline = memrchr(buf + pending, '\n', len);
+        pending += len;
+        size_t complete = newline != NULL ? (size_t)(newline - buf) + 1
+                          : pending == block_size ? pending
+                                                  : 0;
+        if (complete == 0) {
+            continue;
+        }
+        if (write_all(out_fd, buf, complete) < 0) {
+            ret = -1;
+            break;
+        }
+        // What is left came after the last newline, so was only just read
+        pending -= complete;
+        memmove(buf, buf + complete, pending);
+        deadline = monotonic_us() + flush_us;
+    }
+
+    int saved_errno = errno;
+    free(buf);
+    errno = saved_errno;
+    return ret;
+}
+
+int crypt_stream_utf8(const struct caesar_utf8_key *key, int in_fd, int out_fd,
+                      size_t block_size)
+{
+    // Leave room in front of each block for the bytes held back from the
+    // previous one, of which there are at most 3
+    char *buf = malloc(block_size + 3);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    int ret = 0;
+    size_t held = 0;
+    for (;;) {
+        ssize_t len = counted_read(in_fd, buf + held, block_size);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -1;
+            break;
+        }
+
+        // At EOF, a truncated sequence is passed through as it is
+        size_t avail = held + len;
+        size_t done =
+            len == 0 ? avail : caesar_utf8_boundary((uint8_t *)buf, avail);
+        uint64_t start = stats_clock();
+        caesar_utf8_transform_inplace(key, (uint8_t *)buf, done);
+        if (stats != NULL) {
+            stats_add(&stats->transform_ns, stats_clock() - start);
+        }
+
+        if (write_all(out_fd, buf, done) < 0) {
+            ret = -1;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        held = avail - done;
+        memmove(buf, buf + done, held);
+    }
+
+    int saved_errno = errno;
+    free(buf);
+    errno = saved_errno;
+    return ret;
+}
+
+ssize_t read_full(int fd, char *buf, size_t len)
+{
+    size_t total = 0;
+    while (total < len) {
+        ssize_t got = counted_read(fd, buf + total, len - total);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        total += got;
+    }
+
+    return total;
+}
+
+/** State of a chunk slot in the parallel pipeline */
+enum chunk_state {
+    cs_free,    /**< Owned by the reader, waiting to be filled */
+    cs_read,    /**< Filled with input, waiting for a worker */
+    cs_crypted, /**< Crypted, waiting for the writer */
+};
+
+/** One chunk slot of the parallel pipeline's ring buffer */
+struct chunk {
+    char *buf;
+    size_t len;
+    uint64_t pos; /**< Offset of the chunk in the stream */
+    enum chunk_state state;
+};
+
+/**
+ * Shared state of the parallel pipeline. Chunk number n lives in slot
+ * n % nchunks, so the ring doubles as the reorder buffer: the writer only
+ * writes the slot holding the next chunk in input order.
+ *
+ * On NUMA machines, chunks are routed to the nodes in turn: chunk n, and the
+ * buffer of its slot, belongs to node n % nroutes, and is only crypted by the
+ * workers pinned to that node.
+ */
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const struct caesar_key *key;
+    struct chunk *chunks;
+    size_t nchunks;
+    size_t nread;    /**< Number of chunks read so far */
+    size_t nroutes;  /**< Number of nodes chunks are routed to */
+    size_t claimed[NUMA_MAX_NODES]; /**< Chunks claimed by each node */
+    bool eof;        /**< Set once the reader has seen EOF */
+    int err;         /**< First errno seen by any stage, or 0 */
+};
+
+/**
+ * @brief Record a pipeline failure and wake every stage so it can exit
+ * @param pl    Pipeline state, with the lock held
+ * @param err   errno value of the failure
+ */
+static void pipeline_fail(struct pipeline *pl, int err)
+{
+    if (pl->err == 0) {
+        pl->err = err;
+    }
+    pthread_cond_broadcast(&pl->cond);
+}
+
+/** Arguments of a pipeline worker thread */
+struct pipeline_worker_args {
+    struct pipeline *pl;
+    size_t route; /**< Index of the node whose chunks the worker crypts */
+};
+
+/**
+ * @brief Worker thread crypting chunks as soon as they have been read
+ * @param arg   Worker arguments
+ * @return NULL
+ */
+static void *pipeline_worker(void *arg)
+{
+    struct pipeline_worker_args *args = arg;
+    struct pipeline *pl = args->pl;
+    size_t *claimed = &pl->claimed[args->route];
+
+    pthread_mutex_lock(&pl->lock);
+    for (;;) {
+        size_t next;
+        for (;;) {
+            next = *claimed * pl->nroutes + args->route;
+            if (pl->err != 0 || next < pl->nread || pl->eof) {
+                break;
+            }
+            pthread_cond_wait(&pl->cond, &pl->lock);
+        }
+        if (pl->err != 0 || next >= pl->nread) {
+            break;
+        }
+
+        (*claimed)++;
+        struct chunk *chunk = &pl->chunks[next % pl->nchunks];
+        pthread_mutex_unlock(&pl->lock);
+
+        crypt_at(pl->key, chunk->pos, chunk->buf, chunk->len);
+
+        pthread_mutex_lock(&pl->lock);
+        chunk->state = cs_crypted;
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/** Arguments of the pipeline writer thread */
+struct pipeline_writer_args {
+    struct pipeline *pl;
+    int out_fd;
+};
+
+/**
+ * @brief Writer thread emitting crypted chunks in input order
+ * @param arg   Writer arguments
+ * @return NULL
+ */
+static void *pipeline_writer(void *arg)
+{
+    struct pipeline_writer_args *args = arg;
+    struct pipeline *pl = args->pl;
+
+    pthread_mutex_lock(&pl->lock);
+    for (size_t nwritten = 0;; nwritten++) {
+        struct chunk *chunk = &pl->chunks[nwritten % pl->nchunks];
+        while (pl->err == 0 && !(nwritten == pl->nread && pl->eof) &&
+               !(nwritten < pl->nread && chunk->state == cs_crypted)) {
+            pthread_cond_wait(&pl->cond, &pl->lock);
+        }
+        if (pl->err != 0 || nwritten == pl->nread) {
+            break;
+        }
+        pthread_mutex_unlock(&pl->lock);
+
+        int ret = write_all(args->out_fd, chunk->buf, chunk->len);
+        int saved_errno = errno;
+
+        pthread_mutex_lock(&pl->lock);
+        if (ret < 0) {
+            pipeline_fail(pl, saved_errno);
+            break;
+        }
+        chunk->state = cs_free;
+        pthread_cond_broadcast(&pl->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Place the buffers of each node's chunks in that node's memory
+ *
+ * Linux backs a page with memory of the node it is first written from, so the
+ * calling thread moves to each node in turn and clears the buffers of the
+ * chunks routed there, then moves back.
+ *
+ * @param numa          Topology
+ * @param pl            Pipeline state, with buffers not yet written to
+ * @param block_size    Size of each buffer
+ */
+static void pipeline_first_touch(const struct numa *numa, struct pipeline *pl,
+                                 size_t block_size)
+{
+    cpu_set_t saved;
+    if (sched_getaffinity(0, sizeof(saved), &saved) < 0) {
+        return;
+    }
+    for (size_t route = 0; route < pl->nroutes; route++) {
+        if (sched_setaffinity(0, sizeof(numa->nodes[route].cpus),
+                              &numa->nodes[route].cpus) < 0) {
+            continue;
+        }
+        for (size_t i = route; i < pl->nchunks; i += pl->nroutes) {
+            memset(pl->chunks[i].buf, 0, block_size);
+        }
+    }
+    sched_setaffinity(0, sizeof(saved), &saved);
+}
+
+int crypt_stream_parallel(const struct caesar_key *key, int in_fd, int out_fd,
+                          size_t block_size, size_t nthreads)
+{
+    struct pipeline pl = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .key = key,
+    };
+    struct numa numa;
+    numa_read(&numa);
+    pl.nroutes = numa_routes(&numa, nthreads);
+    // Enough slots to keep every worker busy while the writer drains, as many
+    // for every node
+    pl.nchunks = (2 * nthreads + 2 + pl.nroutes - 1) / pl.nroutes * pl.nroutes;
+
+    int ret = -1;
+    struct pool pool = {0};
+    pthread_t *workers = calloc(nthreads, sizeof(*workers));
+    struct pipeline_worker_args *worker_args =
+        calloc(nthreads, sizeof(*worker_args));
+    pl.chunks = calloc(pl.nchunks, sizeof(*pl.chunks));
+    if (workers == NULL || worker_args == NULL || pl.chunks == NULL ||
+        pool_init(&pool, block_size, pl.nchunks, pl.nroutes) < 0) {
+        goto out_free;
+    }
+    // Each node's list holds exactly its slots' buffers, so this cannot fail
+    for (size_t i = 0; i < pl.nchunks; i++) {
+        pl.chunks[i].buf = pool_get(&pool, i % pl.nroutes);
+    }
+    if (pl.nroutes > 1) {
+        pipeline_first_touch(&numa, &pl, block_size);
+    }
+
+    // Workers are pinned to a core of their node, spread over its cores
+    size_t nstarted = 0;
+    for (; nstarted < nthreads; nstarted++) {
+        size_t route = nstarted % pl.nroutes;
+        worker_args[nstarted] = (struct pipeline_worker_args){&pl, route};
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (pl.nroutes > 1) {
+            cpu_set_t cpu;
+            CPU_ZERO(&cpu);
+            CPU_SET(numa_cpu(&numa, route, nstarted / pl.nroutes), &cpu);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+        }
+        errno = pthread_create(&workers[nstarted], &attr, pipeline_worker,
+                               &worker_args[nstarted]);
+        pthread_attr_destroy(&attr);
+        if (errno != 0) {
+            break;
+        }
+    }
+    struct pipeline_writer_args writer_args = {&pl, out_fd};
+    pthread_t writer;
+    bool writer_started = false;
+    if (nstarted == nthreads) {
+        errno = pthread_create(&writer, NULL, pipeline_writer, &writer_args);
+        writer_started = (errno == 0);
+    }
+
+    pthread_mutex_lock(&pl.lock);
+    if (!writer_started) {
+        pipeline_fail(&pl, errno);
+    }
+    while (pl.err == 0) {
+        struct chunk *chunk = &pl.chunks[pl.nread % pl.nchunks];
+        while (pl.err == 0 && chunk->state != cs_free) {
+            pthread_cond_wait(&pl.cond, &pl.lock);
+        }
+        if (pl.err != 0) {
+            break;
+        }
+        pthread_mutex_unlock(&pl.lock);
+
+        ssize_t len = read_full(in_fd, chunk->buf, block_size);
+        int saved_errno = errno;
+
+        pthread_mutex_lock(&pl.lock);
+        if (len < 0) {
+            pipeline_fail(&pl, saved_errno);
+            break;
+        }
+        if (len > 0) {
+            // Every chunk but the last is full
+            chunk->len = len;
+            chunk->pos = (uint64_t)pl.nread * block_size;
+            chunk->state = cs_read;
+            pl.nread++;
+        }
+        if ((size_t)len < block_size) {
+            pl.eof = true;
+            pthread_cond_broadcast(&pl.cond);
+            break;
+        }
+        pthread_cond_broadcast(&pl.cond);
+    }
+    pthread_mutex_unlock(&pl.lock);
+
+    for (size_t i = 0; i < nstarted; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    if (writer_started) {
+        pthread_join(writer, NULL);
+    }
+
+    if (pl.err == 0) {
+        ret = 0;
+    } else {
+        errno = pl.err;
+    }
+
+out_free:;
+    int saved_errno = errno;
+    if (pl.chunks != NULL) {
+        for (size_t i = 0; i < pl.nchunks; i++) {
+            if (pl.chunks[i].buf != NULL) {
+                pool_put(&pool, pl.chunks[i].buf);
+            }
+        }
+    }
+    pool_destroy(&pool);
+    free(pl.chunks);
+    free(worker_args);
+    free(workers);
+    errno = saved_errno;
+    return ret;
+}
+
+/** Slice of a mapped file crypted by one in-place worker thread */
+struct slice {
+    const struct caesar_key *key;
+    char *buf;
+    size_t len;
+    uint64_t pos; /**< Offset of the slice in the file */
+};
+
+/**
+ * @brief Thread crypting one slice of a mapped file
+ * @param arg   Slice to crypt
+ * @return NULL
+ */
+static void *slice_worker(void *arg)
+{
+    struct slice *slice = arg;
+    crypt_at(slice->key, slice->pos, slice->buf, slice->len);
+    return NULL;
+}
+
+int crypt_file_in_place(const struct caesar_key *key, int fd, size_t nthreads)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+
+    size_t len = st.st_size;
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    // Only hints, whose failure is harmless
+    madvise(map, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, len, MADV_HUGEPAGE);
+#endif
+
+    // Slices are whole pages, at least one each, so no more than nthreads
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t per_thread = (len + nthreads - 1) / nthreads;
+    per_thread = (per_thread + page_size - 1) / page_size * page_size;
+    if (per_thread < page_size) {
+        per_thread = page_size;
+    }
+    struct slice *slices = NULL;
+    pthread_t *threads = NULL;
+    if (nthreads > 1 && per_thread < len) {
+        slices = calloc(nthreads, sizeof(*slices));
+        threads = calloc(nthreads, sizeof(*threads));
+    }
+
+    int ret = 0;
+    if (slices == NULL || threads == NULL) {
+        crypt_at(key, 0, map, len);
+    } else {
+        size_t nstarted = 0;
+        for (size_t off = 0; off < len && nstarted < nthreads;
+             off += per_thread) {
+            slices[nstarted].key = key;
+            slices[nstarted].buf = map + off;
+            slices[nstarted].pos = off;
+            slices[nstarted].len = len - off < per_thread ? len - off
+                                                          : per_thread;
+            if (pthread_create(&threads[nstarted], NULL, slice_worker,
+                               &slices[nstarted]) != 0) {
+                // Crypt the slice on this thread instead
+                slice_worker(&slices[nstarted]);
+                continue;
+            }
+            nstarted++;
+        }
+        for (size_t i = 0; i < nstarted; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    free(slices);
+    free(threads);
+
+    if (munmap(map, len) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+int crypt_file_range(const struct caesar_key *key, int in_fd, int out_fd,
+                     uint64_t offset, uint64_t length, size_t block_size)
+{
+    char *buf = malloc(block_size);
+    if (buf == NULL) {
+        return -1;
+    }
+    posix_fadvise(in_fd, offset, length == UINT64_MAX ? 0 : length,
+                  POSIX_FADV_SEQUENTIAL);
+
+    int ret = 0;
+    uint64_t pos = offset;
+    uint64_t left = length;
+    while (left > 0) {
+        size_t want = left < block_size ? left : block_size;
+        uint64_t start = stats_clock();
+        ssize_t len = pread(in_fd, buf, want, pos);
+        if (stats != NULL) {
+            stats_io(&stats->reads, &stats->read_ns, &stats->bytes_read, start,
+                     len);
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -1;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        crypt_at(key, pos, buf, len);
+        if (write_all(out_fd, buf, len) < 0) {
+            ret = -1;
+            break;
+        }
+        pos += len;
+        left -= len;
+    }
+
+    int saved_errno = errno;
+    free(buf);
+    errno = saved_errno;
+    return ret;
+}
+
+bool is_pipe(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/**
+ * @brief Hand an entire buffer to a pipe by reference with vmsplice(2)
+ * @param fd    File descriptor of the pipe to write to
+ * @param buf   Buffer to hand over
+ * @param len   Number of bytes to hand over
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int vmsplice_all(int fd, char *buf, size_t len)
+{
+#ifdef __linux__
+    while (len > 0) {
+        struct iovec iov = {.iov_base = buf, .iov_len = len};
+        uint64_t start = stats_clock();
+        ssize_t spliced = vmsplice(fd, &iov, 1, 0);
+        if (stats != NULL) {
+            stats_io(&stats->writes, &stats->write_ns, &stats->bytes_written,
+                     start, spliced);
+        }
+        if (spliced < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += spliced;
+        len -= spliced;
+    }
+
+    return 0;
+#else
+    (void)fd;
+    (void)buf;
+    (void)len;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int crypt_stream_splice(const struct caesar_key *key, int in_fd, int out_fd)
+{
+    bool use_vmsplice = is_pipe(out_fd);
+    long half = DEFAULT_BLOCK_SIZE;
+#ifdef F_GETPIPE_SZ
+    if (use_vmsplice) {
+        // Growing the pipe is only an optimization, so failure is fine
+        fcntl(out_fd, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+        half = fcntl(out_fd, F_GETPIPE_SZ);
+        if (half <= 0) {
+            use_vmsplice = false;
+            half = DEFAULT_BLOCK_SIZE;
+        }
+    }
+#endif
+
+    char *buf = NULL;
+    if ((errno = posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE),
+                                2 * half)) != 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t pos = 0; // Bytes read so far
+    size_t cur = 0;   // Offset of the half currently being filled
+    size_t off = 0;   // Bytes already filled in the current half
+    for (;;) {
+        ssize_t len = counted_read(in_fd, buf + cur + off, half - off);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -1;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        char *block = buf + cur + off;
+        crypt_at(key, pos, block, len);
+        pos += len;
+
+        if (use_vmsplice && vmsplice_all(out_fd, block, len) < 0) {
+            if (errno != EINVAL && errno != ENOSYS) {
+                ret = -1;
+                break;
+            }
+            // Splicing is not supported here, so fall back to copying
+            use_vmsplice = false;
+        }
+        if (!use_vmsplice && write_all(out_fd, block, len) < 0) {
+            ret = -1;
+            break;
+        }
+
+        off += len;
+        if (off == (size_t)half) {
+            cur = cur == 0 ? half : 0;
+            off = 0;
+        }
+    }
+
+    int saved_errno = errno;
+    free(buf);
+    errno = saved_errno;
+    return ret;
+}
+
+#ifdef HAVE_ZLIB
+/**
+ * @brief Crypt a gzip stream, as described for crypt_stream_compressed()
+ * @param key           Prepared key
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param inbuf         Buffer of COMPRESSED_BUF_SIZE bytes for the input
+ * @param block         Buffer of block_size bytes
+ * @param block_size    Size of block
+ * @param outbuf        Buffer of COMPRESSED_BUF_SIZE bytes for the output
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int crypt_stream_gzip(const struct caesar_key *key, int in_fd,
+                             int out_fd, char *inbuf, char *block,
+                             size_t block_size, char *outbuf)
+{
+    z_stream inflater = {0};
+    z_stream deflater = {0};
+    // Adding 32 detects a gzip or zlib header, adding 16 writes gzip
+    if (inflateInit2(&inflater, 15 + 32) != Z_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        inflateEnd(&inflater);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ret = 0;
+    bool eof = false;
+    bool in_member = false; // Whether the input stopped inside a member
+    uint64_t pos = 0;
+    while (ret == 0) {
+        inflater.next_out = (Bytef *)block;
+        inflater.avail_out = block_size;
+        while (inflater.avail_out > 0) {
+            if (inflater.avail_in == 0) {
+                ssize_t len = counted_read(in_fd, inbuf, COMPRESSED_BUF_SIZE);
+                if (len < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    ret = -1;
+                    break;
+                }
+                if (len == 0) {
+                    eof = true;
+                    break;
+                }
+                inflater.next_in = (Bytef *)inbuf;
+                inflater.avail_in = len;
+            }
+
+            in_member = true;
+            int zret = inflate(&inflater, Z_NO_FLUSH);
+            if (zret == Z_STREAM_END) {
+                // Carry on with the next member, if any
+                in_member = false;
+                zret = inflateReset(&inflater);
+            }
+            if (zret != Z_OK) {
+                errno = zret == Z_MEM_ERROR ? ENOMEM : EBADMSG;
+                ret = -1;
+                break;
+            }
+        }
+        if (ret == 0 && eof && in_member) {
+            errno = EBADMSG;
+            ret = -1;
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        size_t len = block_size - inflater.avail_out;
+        crypt_at(key, pos, block, len);
+        pos += len;
+
+        deflater.next_in = (Bytef *)block;
+        deflater.avail_in = len;
+        do {
+            deflater.next_out = (Bytef *)outbuf;
+            deflater.avail_out = COMPRESSED_BUF_SIZE;
+            deflate(&deflater, eof ? Z_FINISH : Z_NO_FLUSH);
+            if (write_all(out_fd, outbuf,
+                          COMPRESSED_BUF_SIZE - deflater.avail_out) < 0) {
+                ret = -1;
+                break;
+            }
+        } while (deflater.avail_out == 0);
+        if (eof) {
+            break;
+        }
+    }
+
+    int saved_errno = errno;
+    inflateEnd(&inflater);
+    deflateEnd(&deflater);
+    errno = saved_errno;
+    return ret;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/**
+ * @brief Crypt a zstd stream, as described for crypt_stream_compressed()
+ * @param key           Prepared key
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param inbuf         Buffer of COMPRESSED_BUF_SIZE bytes for the input
+ * @param block         Buffer of block_size bytes
+ * @param block_size    Size of block
+ * @param outbuf        Buffer of COMPRESSED_BUF_SIZE bytes for the output
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int crypt_stream_zstd(const struct caesar_key *key, int in_fd,
+                             int out_fd, char *inbuf, char *block,
+                             size_t block_size, char *outbuf)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (dctx == NULL || cctx == NULL) {
+        ZSTD_freeDCtx(dctx);
+        ZSTD_freeCCtx(cctx);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ret = 0;
+    bool eof = false;
+    bool in_frame = false; // Whether the input stopped inside a frame
+    uint64_t pos = 0;
+    ZSTD_inBuffer in = {inbuf, 0, 0};
+    while (ret == 0) {
+        ZSTD_outBuffer decoded = {block, block_size, 0};
+        while (decoded.pos < decoded.size) {
+            if (in.pos == in.size && !eof) {
+                ssize_t len = counted_read(in_fd, inbuf, COMPRESSED_BUF_SIZE);
+                if (len < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    ret = -1;
+                    break;
+                }
+                eof = len == 0;
+                in.size = len;
+                in.pos = 0;
+            }
+            if (eof && !in_frame) {
+                break;
+            }
+
+            // Returns 0 once a frame has been decoded and flushed. At the end
+            // of the input, the context may still hold decoded bytes, so it is
+            // drained until it stops producing any.
+            size_t before = decoded.pos;
+            size_t zret = ZSTD_decompressStream(dctx, &decoded, &in);
+            if (ZSTD_isError(zret)) {
+                errno = EBADMSG;
+                ret = -1;
+                break;
+            }
+            in_frame = zret != 0;
+            if (eof && in_frame && decoded.pos == before) {
+                // The input stopped inside a frame
+                errno = EBADMSG;
+                ret = -1;
+                break;
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+        bool finished = eof && !in_frame;
+
+        crypt_at(key, pos, block, decoded.pos);
+        pos += decoded.pos;
+
+        ZSTD_inBuffer plain = {block, decoded.pos, 0};
+        ZSTD_EndDirective mode = finished ? ZSTD_e_end : ZSTD_e_continue;
+        size_t left;
+        do {
+            ZSTD_outBuffer out = {outbuf, COMPRESSED_BUF_SIZE, 0};
+            left = ZSTD_compressStream2(cctx, &out, &plain, mode);
+            if (ZSTD_isError(left)) {
+                errno = EIO;
+                ret = -1;
+                break;
+            }
+            if (write_all(out_fd, outbuf, out.pos) < 0) {
+                ret = -1;
+                break;
+            }
+        } while (finished ? left != 0 : plain.pos < plain.size);
+        if (finished) {
+            break;
+        }
+    }
+
+    int saved_errno = errno;
+    ZSTD_freeDCtx(dctx);
+    ZSTD_freeCCtx(cctx);
+    errno = saved_errno;
+    return ret;
+}
+#endif
+
+bool stream_format_supported(enum stream_format format)
+{
+    switch (format) {
+    case sf_gzip:
+#ifdef HAVE_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    case sf_zstd:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+int crypt_stream_compressed(const struct caesar_key *key,
+                            enum stream_format format, int in_fd, int out_fd,
+                            size_t block_size)
+{
+#if !defined(HAVE_ZLIB) && !defined(HAVE_ZSTD)
+    (void)key;
+    (void)in_fd;
+    (void)out_fd;
+#endif
+    if (!stream_format_supported(format)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    int ret = -1;
+    char *inbuf = malloc(COMPRESSED_BUF_SIZE);
+    char *block = malloc(block_size);
+    char *outbuf = malloc(COMPRESSED_BUF_SIZE);
+    if (inbuf != NULL && block != NULL && outbuf != NULL) {
+        switch (format) {
+        case sf_gzip:
+#ifdef HAVE_ZLIB
+            ret = crypt_stream_gzip(key, in_fd, out_fd, inbuf, block,
+                                    block_size, outbuf);
+#endif
+            break;
+        case sf_zstd:
+#ifdef HAVE_ZSTD
+            ret = crypt_stream_zstd(key, in_fd, out_fd, inbuf, block,
+                                    block_size, outbuf);
+#endif
+            break;
+        }
+    }
+
+    int saved_errno = errno;
+    free(inbuf);
+    free(block);
+    free(outbuf);
+    errno = saved_errno;
+    return ret;
+}
+
+int crypt_stream_with(const struct caesar_key *key, int in_fd, int out_fd,
+                      size_t block_size, size_t jobs, bool use_splice)
+{
+    if (use_splice && jobs == 1 && is_pipe(in_fd) && is_pipe(out_fd)) {
+        return crypt_stream_splice(key, in_fd, out_fd);
+    }
+    if (jobs > 1) {
+        return crypt_stream_parallel(key, in_fd, out_fd, block_size, jobs);
+    }
+    return crypt_stream(key, in_fd, out_fd, block_size);
+}
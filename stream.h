@@ -0,0 +1,227 @@
+/**
+ * @file stream.h
+ * Stream engines crypting input from file descriptors.
+ */
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "caesar.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Default size in bytes of the block buffer used by crypt_stream() */
+#define DEFAULT_BLOCK_SIZE (128 * 1024)
+
+/**
+ * @brief Write an entire buffer to a file descriptor
+ * @param fd    File descriptor to write to
+ * @param buf   Buffer to write
+ * @param len   Number of bytes to write
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int write_all(int fd, const char *buf, size_t len);
+
+/**
+ * @brief Read from a file descriptor until a buffer is full or EOF is reached
+ * @param fd    File descriptor to read from
+ * @param buf   Buffer to read into
+ * @param len   Size of the buffer
+ * @return Number of bytes read, which is less than len only at EOF, or -1 on
+ *         failure with errno set
+ */
+ssize_t read_full(int fd, char *buf, size_t len);
+
+/**
+ * @brief Check whether a file descriptor refers to a pipe
+ * @param fd    File descriptor to check
+ * @return true if fd is a pipe or FIFO
+ */
+bool is_pipe(int fd);
+
+/**
+ * @brief Crypt an ASCII stream, not changing non-alphabetic characters
+ *
+ * The input is read a block at a time into a reusable buffer, crypted in
+ * place and written out with a single call per block. When built with
+ * io_uring support and the running kernel provides it, crypt_stream_uring()
+ * is used instead.
+ *
+ * @param key           Prepared key
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param block_size    Size in bytes of the block buffer
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int crypt_stream(const struct caesar_key *key, int in_fd, int out_fd,
+                 size_t block_size);
+
+/**
+ * @brief Check whether crypt_stream() goes through io_uring
+ * @return true if built with io_uring support and the running kernel
+ *         provides what crypt_stream_uring() needs
+ */
+bool stream_uring_supported(void);
+
+/**
+ * @brief Crypt a UTF-8 stream, not changing characters outside the alphabet
+ *
+ * Works like crypt_stream(), except that a multi-byte sequence cut off at the
+ * end of a block is held back and crypted with the next block.
+ *
+ * @param key           Prepared UTF-8 key
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param block_size    Size in bytes of the block buffer
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int crypt_stream_utf8(const struct caesar_utf8_key *key, int in_fd, int out_fd,
+                      size_t block_size);
+
+/**
+ * @brief Crypt an ASCII stream using several worker threads
+ *
+ * The calling thread reads fixed-size chunks into a ring of slots, a pool of
+ * workers crypts them in any order, and a writer thread writes them out in
+ * input order. Reading, crypting and writing of different chunks overlap.
+ *
+ * On machines with several NUMA nodes, workers are spread over the nodes and
+ * pinned to their cores, and chunks are routed to the nodes in turn, each
+ * into a buffer in its node's memory, so every chunk is crypted where it lives.
+ *
+ * @param key           Prepared key
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param block_size    Size in bytes of each chunk
+ * @param nthreads      Number of worker threads
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int crypt_stream_parallel(const struct caesar_key *key, int in_fd, int out_fd,
+                          size_t block_size, size_t nthreads);
+
+/**
+ * @brief Crypt a regular file in place by mapping it into memory
+ *
+ * The pages of the file are crypted directly in the page cache, so the data is
+ * never copied into a user buffer. With more than one thread, the mapping is
+ * split into page-aligned slices crypted in parallel.
+ *
+ * @param key       Prepared key
+ * @param fd        File descriptor of the file, opened for reading and writing
+ * @param nthreads  Number of threads to crypt with
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int crypt_file_in_place(const struct caesar_key *key, int fd, size_t nthreads);
+
+/**
+ * @brief Crypt a byte range of a seekable file
+ *
+ * Only the range is read, with pread(2), so the time taken depends on its
+ * length rather than its offset. Every key crypts a byte depending only on
+ * its position, so the output is the same as that range of crypting the whole
+ * file.
+ *
+ * @param key           Prepared key
+ * @param in_fd         File descriptor of the file to read from
+ * @param out_fd        File descriptor to write to
+ * @param offset        Offset of the first byte of the range
+ * @param length        Number of bytes in the range, or UINT64_MAX for all up
+ *                      to the end of the file. A range running past the end
+ *                      of the file stops there.
+ * @param block_size    Size in bytes of the block buffer
+ * @return 0 on success, or -1 on failure with errno set, ESPIPE if in_fd is
+ *         not seekable
+ */
+int crypt_file_range(const struct caesar_key *key, int in_fd, int out_fd,
+                     uint64_t offset, uint64_t length, size_t block_size);
+
+/**
+ * @brief Crypt a stream with low latency, writing each line as soon as it ends
+ *
+ * Whatever input is available is read and crypted at once, and everything up
+ * to its last newline is written with a single write(2), so a burst of lines
+ * costs no more system calls than a block. An unfinished line is held back
+ * until its newline arrives, the buffer fills up, or, if flush_us is not 0, it
+ * has waited that long, which poll(2) bounds while input is idle.
+ *
+ * @param key           Prepared key
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param block_size    Size in bytes of the buffer, the longest line held
+ * @param flush_us      Longest time in microseconds an unfinished line is
+ *                      held, or 0 to hold it until its newline
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int crypt_stream_lines(const struct caesar_key *key, int in_fd, int out_fd,
+                       size_t block_size, uint64_t flush_us);
+
+/**
+ * @brief Crypt a stream from a pipe into a pipe without copying the output
+ *
+ * Crypted data is handed to the output pipe by reference with vmsplice(2)
+ * rather than copied into it with write(2). Since the pipe then refers to our
+ * pages, a page must not be changed until the reader has consumed it. The
+ * buffer is therefore split into two halves of exactly the pipe's capacity,
+ * used in turn: once a whole half has been pushed through the pipe, nothing
+ * from the other half can still be in it. This relies on the reader copying
+ * data out of the pipe, which is why this path is opt-in.
+ *
+ * If the output is not a pipe or vmsplice(2) is unavailable, the data is
+ * written with write(2) instead.
+ *
+ * @param key       Prepared key
+ * @param in_fd     File descriptor to read from
+ * @param out_fd    File descriptor of the pipe to write to
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int crypt_stream_splice(const struct caesar_key *key, int in_fd, int out_fd);
+
+/** Compressed formats handled by crypt_stream_compressed() */
+enum stream_format {
+    sf_gzip, /**< gzip, or zlib on input, built with `make ZLIB=1` */
+    sf_zstd, /**< Zstandard, built with `make ZSTD=1` */
+};
+
+/**
+ * @brief Check whether support for a compressed format was built in
+ * @param format    Format to check
+ * @return true if crypt_stream_compressed() handles format
+ */
+bool stream_format_supported(enum stream_format format);
+
+/**
+ * @brief Crypt a compressed stream, writing it compressed the same way
+ *
+ * Each block of input is decompressed straight into the block buffer, crypted
+ * in place there, and compressed from it into the output buffer, all on the
+ * calling thread. Concatenated gzip members or zstd frames are read as one
+ * stream, and the output is a single member or frame.
+ *
+ * @param key           Prepared key
+ * @param format        Format of the input and output
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param block_size    Size in bytes of the decompressed block buffer
+ * @return 0 on success, or -1 on failure with errno set, EBADMSG if the input
+ *         is corrupt or truncated and ENOTSUP if format is not supported
+ */
+int crypt_stream_compressed(const struct caesar_key *key,
+                            enum stream_format format, int in_fd, int out_fd,
+                            size_t block_size);
+
+/**
+ * @brief Crypt a stream with whichever engine the options ask for
+ * @param key           Prepared key
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param block_size    Size in bytes of each block
+ * @param jobs          Number of worker threads
+ * @param use_splice    Whether to vmsplice into the output pipe
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int crypt_stream_with(const struct caesar_key *key, int in_fd, int out_fd,
+                      size_t block_size, size_t jobs, bool use_splice);
+
+#endif
@@ -0,0 +1,280 @@
+/**
+ * @file tune.c
+ * Autotuner picking the block size and thread count for a stream.
+ */
+#define _GNU_SOURCE
+#include "tune.h"
+
+#include "stats.h"
+#include "stream.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Candidate block sizes, probed in order */
+static const size_t BLOCK_SIZES[] = {
+    64 * 1024,
+    256 * 1024,
+    1024 * 1024,
+    4 * 1024 * 1024,
+};
+
+/** Number of candidate block sizes */
+#define NBLOCK_SIZES (sizeof(BLOCK_SIZES) / sizeof(BLOCK_SIZES[0]))
+
+/** Longest host name or input type kept in the cache, plus the NUL */
+#define CACHE_FIELD_MAX 256
+
+/** Longest line of the cache file */
+#define CACHE_LINE_MAX (2 * CACHE_FIELD_MAX + 64)
+
+/** Settings chosen for a stream */
+struct tune {
+    size_t block_size;
+    size_t jobs;
+};
+
+/**
+ * @brief Read the monotonic clock
+ * @return Time in nanoseconds
+ */
+static unsigned long long tune_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Name the type of file a descriptor refers to
+ * @param fd    File descriptor to check
+ * @return "file", "pipe", "socket" or "other"
+ */
+static const char *input_kind(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return "other";
+    }
+    return S_ISREG(st.st_mode)    ? "file"
+           : S_ISFIFO(st.st_mode) ? "pipe"
+           : S_ISSOCK(st.st_mode) ? "socket"
+                                  : "other";
+}
+
+/**
+ * @brief Look up the settings cached for this host and input type
+ * @param path  Path of the cache file
+ * @param host  Name of this host
+ * @param kind  Type of the input
+ * @param tune  Set to the cached settings if found
+ * @return true if settings were found
+ */
+static bool cache_load(const char *path, const char *host, const char *kind,
+                       struct tune *tune)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    bool found = false;
+    char line[CACHE_LINE_MAX];
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        char line_host[CACHE_FIELD_MAX];
+        char line_kind[CACHE_FIELD_MAX];
+        size_t block_size;
+        size_t jobs;
+        if (sscanf(line, "%255s %255s %zu %zu", line_host, line_kind,
+                   &block_size, &jobs) == 4 &&
+            strcmp(line_host, host) == 0 && strcmp(line_kind, kind) == 0 &&
+            block_size > 0 && jobs > 0) {
+            tune->block_size = block_size;
+            tune->jobs = jobs;
+            found = true;
+        }
+    }
+    fclose(f);
+
+    return found;
+}
+
+/**
+ * @brief Save the settings for this host and input type in the cache
+ *
+ * Other entries are kept. The file is replaced atomically, so concurrent runs
+ * never see it half written.
+ *
+ * @param path  Path of the cache file
+ * @param host  Name of this host
+ * @param kind  Type of the input
+ * @param tune  Settings to save
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int cache_store(const char *path, const char *host, const char *kind,
+                       const struct tune *tune)
+{
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path,
+                 (long)getpid()) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        char line[CACHE_LINE_MAX];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            char line_host[CACHE_FIELD_MAX];
+            char line_kind[CACHE_FIELD_MAX];
+            if (sscanf(line, "%255s %255s", line_host, line_kind) == 2 &&
+                strcmp(line_host, host) == 0 && strcmp(line_kind, kind) == 0) {
+                continue;
+            }
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s %s %zu %zu\n", host, kind, tune->block_size, tune->jobs);
+
+    if (fclose(out) != 0 || rename(tmp_path, path) < 0) {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Crypt part of a stream with the block engine, timing it
+ * @param key           Prepared key
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param buf           Buffer of at least block_size bytes
+ * @param block_size    Size of each read
+ * @param pos           Offset in the stream, advanced past the bytes crypted
+ * @param eof           Set if the end of the input was reached
+ * @param total_ns      Set to the time taken in all
+ * @param crypt_ns      Set to the time taken crypting
+ * @return Number of bytes crypted, or -1 on failure with errno set
+ */
+static ssize_t probe(const struct caesar_key *key, int in_fd, int out_fd,
+                     char *buf, size_t block_size, uint64_t *pos, bool *eof,
+                     unsigned long long *total_ns,
+                     unsigned long long *crypt_ns)
+{
+    size_t done = 0;
+    unsigned long long start = tune_now_ns();
+    *crypt_ns = 0;
+    while (done < TUNE_PROBE_SIZE) {
+        unsigned long long read_start = tune_now_ns();
+        ssize_t len = read(in_fd, buf, block_size);
+        if (stats != NULL) {
+            stats_io(&stats->reads, &stats->read_ns, &stats->bytes_read,
+                     read_start, len);
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (len == 0) {
+            *eof = true;
+            break;
+        }
+
+        unsigned long long crypt_start = tune_now_ns();
+        caesar_transform_inplace_at(key, *pos, (uint8_t *)buf, len);
+        unsigned long long crypt_end = tune_now_ns();
+        *crypt_ns += crypt_end - crypt_start;
+        if (stats != NULL) {
+            stats_add(&stats->transform_ns, crypt_end - crypt_start);
+        }
+
+        if (write_all(out_fd, buf, len) < 0) {
+            return -1;
+        }
+        *pos += len;
+        done += len;
+    }
+    *total_ns = tune_now_ns() - start;
+
+    return done;
+}
+
+int crypt_stream_auto(const struct caesar_key *key, int in_fd, int out_fd,
+                      bool use_splice, const char *cache_path)
+{
+    char host[HOST_NAME_MAX + 1] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    const char *kind = input_kind(in_fd);
+
+    struct tune tune;
+    uint64_t pos = 0;
+    if (cache_path == NULL || !cache_load(cache_path, host, kind, &tune)) {
+        char *buf = malloc(BLOCK_SIZES[NBLOCK_SIZES - 1]);
+        if (buf == NULL) {
+            return -1;
+        }
+
+        // Score each block size by its throughput, keeping the share of time
+        // spent crypting with the best one
+        bool eof = false;
+        double best_rate = 0;
+        double crypt_share = 0;
+        tune.block_size = BLOCK_SIZES[0];
+        for (size_t i = 0; i < NBLOCK_SIZES && !eof; i++) {
+            unsigned long long total_ns;
+            unsigned long long crypt_ns;
+            ssize_t done = probe(key, in_fd, out_fd, buf, BLOCK_SIZES[i], &pos,
+                                 &eof, &total_ns, &crypt_ns);
+            if (done < 0) {
+                int saved_errno = errno;
+                free(buf);
+                errno = saved_errno;
+                return -1;
+            }
+            double rate = total_ns > 0 ? (double)done / total_ns : 0;
+            if (rate > best_rate) {
+                best_rate = rate;
+                tune.block_size = BLOCK_SIZES[i];
+                crypt_share = total_ns > 0 ? (double)crypt_ns / total_ns : 0;
+            }
+        }
+        free(buf);
+        if (eof) {
+            return 0;
+        }
+
+        // If crypting is a share s of the time, about 1 / (1 - s) threads
+        // crypt as fast as the I/O goes
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        tune.jobs = 1;
+        if (crypt_share > 0.5 && ncpus > 1) {
+            double wanted = 1 / (1 - crypt_share) + 0.5;
+            tune.jobs = wanted < ncpus ? (size_t)wanted : (size_t)ncpus;
+        }
+
+        // If the cache cannot be written, the next run just times again
+        if (cache_path != NULL) {
+            cache_store(cache_path, host, kind, &tune);
+        }
+    }
+
+    struct caesar_key rest = *key;
+    caesar_key_advance(&rest, pos);
+    return crypt_stream_with(&rest, in_fd, out_fd, tune.block_size, tune.jobs,
+                             use_splice);
+}
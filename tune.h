@@ -0,0 +1,38 @@
+/**
+ * @file tune.h
+ * Autotuner picking the block size and thread count for a stream.
+ */
+#ifndef TUNE_H
+#define TUNE_H
+
+#include "caesar.h"
+
+#include <stdbool.h>
+
+/** Bytes crypted with each candidate block size while probing */
+#define TUNE_PROBE_SIZE (2 * 1024 * 1024)
+
+/**
+ * @brief Crypt a stream with a block size and thread count tuned for it
+ *
+ * The start of the stream is crypted with the block engine, a few MiB with
+ * each candidate block size, timing how long reading, crypting and writing
+ * take. The fastest block size is kept. If crypting took most of the time,
+ * the rest of the stream is spread over enough threads to keep up with the
+ * I/O, up to the number of online CPUs.
+ *
+ * With a cache file, the settings found for this host and input type (pipe,
+ * regular file, socket or other, from fstat(2)) are saved there, and later
+ * runs skip the probe.
+ *
+ * @param key           Prepared key
+ * @param in_fd         File descriptor to read from
+ * @param out_fd        File descriptor to write to
+ * @param use_splice    Whether to vmsplice into the output pipe
+ * @param cache_path    Path of the cache file, or NULL to always probe
+ * @return 0 on success, or -1 on failure with errno set
+ */
+int crypt_stream_auto(const struct caesar_key *key, int in_fd, int out_fd,
+                      bool use_splice, const char *cache_path);
+
+#endif
@@ -0,0 +1,835 @@
+/**
+ * @file verify.c
+ * Differential check of every kernel and stream engine against a model.
+ */
+#define _GNU_SOURCE
+#include "verify.h"
+
+#include "caesar.h"
+#include "stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/** Random buffers crypted per kernel and spelling of a shift */
+#define VERIFY_ROUNDS 32
+
+/** Random keywords crypted per kernel */
+#define VERIFY_KEYWORD_ROUNDS 2000
+
+/** Longest buffer crypted by a single kernel call */
+#define VERIFY_MAX_LEN 4096
+
+/** Largest misalignment of a buffer, and bytes checked on each side of it */
+#define VERIFY_GUARD 64
+
+/** Size of the areas buffers are placed in, guards included */
+#define VERIFY_AREA (VERIFY_MAX_LEN + 3 * VERIFY_GUARD)
+
+/** Value of the guard bytes, a letter so that crypting it changes it */
+#define VERIFY_CANARY 'm'
+
+/** Alphabet of the keys checked with the table-driven kernels */
+#define VERIFY_ALPHABET "a-z,A-Z,0-9"
+
+/** Random files crypted per stream engine */
+#define VERIFY_STREAM_ROUNDS 40
+
+/** Largest file crypted by a stream engine */
+#define VERIFY_STREAM_MAX (1024 * 1024)
+
+/** Stream engines checked */
+enum verify_engine {
+    ve_stream,   /**< crypt_stream(), with io_uring if built with it */
+    ve_pipe,     /**< crypt_stream() from a pipe into a pipe */
+    ve_splice,   /**< crypt_stream_splice() from a pipe into a pipe */
+    ve_parallel, /**< crypt_stream_parallel() */
+    ve_lines,    /**< crypt_stream_lines() */
+    ve_range,    /**< crypt_file_range() */
+    ve_in_place, /**< crypt_file_in_place() */
+    ve_zstd,     /**< crypt_stream_compressed() on a zstd stream */
+    ve_count,
+};
+
+/** Name of each stream engine */
+static const char *const ENGINE_NAMES[ve_count] = {
+    [ve_stream] = "stream",     [ve_pipe] = "pipe",
+    [ve_splice] = "splice",     [ve_parallel] = "parallel",
+    [ve_lines] = "lines",       [ve_range] = "range",
+    [ve_in_place] = "in_place", [ve_zstd] = "zstd",
+};
+
+/** Name of the engines that go through io_uring when the kernel provides it */
+static const char *const URING_ENGINE_NAMES[ve_count] = {
+    [ve_stream] = "uring",
+    [ve_pipe] = "uring_pipe",
+};
+
+/**
+ * Textbook definition of a key, crypting independently of caesar.c: letters
+ * are shifted by the shift for their position, and digits by digit_shift.
+ */
+struct verify_model {
+    uint8_t shifts[CAESAR_KEYWORD_MAX]; /**< Right-shift of each position */
+    size_t period;                      /**< Number of shifts */
+    int digit_shift;                    /**< Right-shift of digits, or 0 */
+    char desc[64];                      /**< Description for failures */
+};
+
+/** Cases and failures of one kernel or engine */
+struct verify_tally {
+    const char *name;
+    unsigned long long cases;
+    unsigned long long failures;
+};
+
+/** End of a pipe fed or drained by a thread of verify_pipe() */
+struct verify_pipe_end {
+    int fd;        /**< Write end to feed, or read end to drain */
+    uint8_t *data; /**< Bytes to feed, or buffer to drain into */
+    size_t len;    /**< Number of bytes to feed, or drained */
+    size_t cap;    /**< Size of the buffer drained into */
+    int err;       /**< errno of a failed read or write, or 0 */
+};
+
+/** Buffers reused for every kernel case */
+struct verify_bufs {
+    uint8_t in[VERIFY_AREA];
+    uint8_t out[VERIFY_AREA];
+    uint8_t expected[VERIFY_MAX_LEN];
+};
+
+/**
+ * @brief Draw the next number of an xorshift64* generator
+ * @param state State of the generator, never 0
+ * @return Pseudo-random number
+ */
+static uint64_t verify_rand(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * @brief Fill a buffer with random bytes, mostly letters and their neighbours
+ * @param state State of the generator
+ * @param buf   Buffer to fill
+ * @param len   Number of bytes
+ */
+static void verify_fill(uint64_t *state, uint8_t *buf, size_t len)
+{
+    static const char edges[] = "@AZ[`az{/09:";
+    for (size_t i = 0; i < len; i++) {
+        uint64_t r = verify_rand(state);
+        switch (r % 4) {
+        case 0:
+            buf[i] = r >> 8;
+            break;
+        case 1:
+            buf[i] = edges[(r >> 8) % (sizeof(edges) - 1)];
+            break;
+        default:
+            buf[i] = ((r >> 8) & 1 ? 'a' : 'A') + (r >> 9) % 26;
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Reduce a shift to [0, n) the way modular arithmetic defines it
+ * @param shift Shift, possibly negative
+ * @param n     Size of the alphabet
+ * @return Equivalent right-shift
+ */
+static int verify_reduce(long shift, int n)
+{
+    return (int)((shift % n + n) % n);
+}
+
+/**
+ * @brief Crypt a buffer with a model
+ * @param model Model of the key
+ * @param pos   Offset in the stream of the first byte
+ * @param in    Bytes to crypt
+ * @param out   Buffer of n bytes for the result
+ * @param n     Number of bytes
+ */
+static void verify_model_crypt(const struct verify_model *model, uint64_t pos,
+                               const uint8_t *in, uint8_t *out, size_t n)
+{
+    size_t phase = pos % model->period;
+    for (size_t i = 0; i < n; i++) {
+        uint8_t c = in[i];
+        int shift = model->shifts[phase];
+        if (c >= 'A' && c <= 'Z') {
+            c = 'A' + (c - 'A' + shift) % 26;
+        } else if (c >= 'a' && c <= 'z') {
+            c = 'a' + (c - 'a' + shift) % 26;
+        } else if (c >= '0' && c <= '9') {
+            c = '0' + (c - '0' + model->digit_shift) % 10;
+        }
+        out[i] = c;
+        phase = phase + 1 == model->period ? 0 : phase + 1;
+    }
+}
+
+/**
+ * @brief Prepare a key and its model for a shift
+ * @param key       Key to initialize
+ * @param model     Model to fill in
+ * @param shift     Shift
+ * @param alphabet  Whether to rotate digits too, with VERIFY_ALPHABET
+ */
+static void verify_shift_key(struct caesar_key *key, struct verify_model *model,
+                             long shift, bool alphabet)
+{
+    if (alphabet) {
+        caesar_key_init_alphabet(key, shift, VERIFY_ALPHABET);
+    } else {
+        caesar_key_init(key, shift);
+    }
+    model->shifts[0] = verify_reduce(shift, 26);
+    model->period = 1;
+    model->digit_shift = alphabet ? verify_reduce(shift, 10) : 0;
+    snprintf(model->desc, sizeof(model->desc), "%s %ld",
+             alphabet ? "alphabet shift" : "shift", shift);
+}
+
+/**
+ * @brief Prepare a random keyword key and its model
+ * @param state State of the generator
+ * @param key   Key to initialize
+ * @param model Model to fill in
+ */
+static void verify_keyword_key(uint64_t *state, struct caesar_key *key,
+                               struct verify_model *model)
+{
+    // Mostly short keywords, sometimes up to the longest allowed
+    uint64_t r = verify_rand(state);
+    size_t period = 1 + (r % 8 == 0 ? (r >> 3) % CAESAR_KEYWORD_MAX
+                                    : (r >> 3) % 16);
+    bool decrypt = (r >> 20) & 1;
+    char keyword[CAESAR_KEYWORD_MAX + 1];
+    for (size_t i = 0; i < period; i++) {
+        r = verify_rand(state);
+        int shift = r % 26;
+        keyword[i] = ((r >> 8) & 1 ? 'a' : 'A') + shift;
+        model->shifts[i] = decrypt ? (26 - shift) % 26 : shift;
+    }
+    keyword[period] = '\0';
+    caesar_key_init_keyword(key, keyword, decrypt);
+    model->period = period;
+    model->digit_shift = 0;
+    snprintf(model->desc, sizeof(model->desc), "%s keyword of %zu letters",
+             decrypt ? "decrypting" : "encrypting", period);
+}
+
+/**
+ * @brief Check an output against the expected bytes and the guards around it
+ * @param tally     Tally to count the case in
+ * @param desc      Description of the case, printed on its failure
+ * @param area      Area the output was written into
+ * @param area_size Size of the area
+ * @param start     Offset of the output in the area
+ * @param expected  Expected output
+ * @param n         Length of the expected output
+ */
+static void verify_output(struct verify_tally *tally, const char *desc,
+                          const uint8_t *area, size_t area_size, size_t start,
+                          const uint8_t *expected, size_t n)
+{
+    tally->cases++;
+    for (size_t i = 0; i < area_size; i++) {
+        bool inside = i >= start && i - start < n;
+        uint8_t want = inside ? expected[i - start] : VERIFY_CANARY;
+        if (area[i] == want) {
+            continue;
+        }
+        if (tally->failures++ == 0) {
+            fprintf(stderr, "verify: %s: %s: %s byte %lld is 0x%02x, "
+                            "expected 0x%02x\n",
+                    tally->name, desc, inside ? "output" : "guard",
+                    (long long)i - (long long)start, area[i], want);
+        }
+        return;
+    }
+}
+
+/**
+ * @brief Check a key on a random buffer, in and out of place
+ * @param state     State of the generator
+ * @param tally     Tally to count the cases in
+ * @param bufs      Buffers to use
+ * @param key       Key to check
+ * @param key_pos   Offset to crypt at with the key
+ * @param model     Model of the key
+ * @param model_pos Offset the model crypts at
+ */
+static void verify_case(uint64_t *state, struct verify_tally *tally,
+                        struct verify_bufs *bufs, const struct caesar_key *key,
+                        uint64_t key_pos, const struct verify_model *model,
+                        uint64_t model_pos)
+{
+    // Mostly short buffers, where the vector kernels' tails are
+    uint64_t r = verify_rand(state);
+    size_t n = r % 2 ? (r >> 1) % 257 : (r >> 1) % (VERIFY_MAX_LEN + 1);
+    size_t in_start = VERIFY_GUARD + (r >> 16) % VERIFY_GUARD;
+    size_t out_start = VERIFY_GUARD + (r >> 24) % VERIFY_GUARD;
+    verify_fill(state, bufs->in, VERIFY_AREA);
+    verify_model_crypt(model, model_pos, bufs->in + in_start, bufs->expected,
+                       n);
+
+    char desc[160];
+    snprintf(desc, sizeof(desc), "%s at %llu, %zu bytes, input offset %zu, "
+                                 "output offset %zu",
+             model->desc, (unsigned long long)model_pos, n,
+             in_start - VERIFY_GUARD, out_start - VERIFY_GUARD);
+    memset(bufs->out, VERIFY_CANARY, VERIFY_AREA);
+    caesar_transform_at(key, key_pos, bufs->in + in_start,
+                        bufs->out + out_start, n);
+    verify_output(tally, desc, bufs->out, VERIFY_AREA, out_start,
+                  bufs->expected, n);
+
+    snprintf(desc, sizeof(desc), "%s at %llu, %zu bytes in place at offset "
+                                 "%zu",
+             model->desc, (unsigned long long)model_pos, n,
+             in_start - VERIFY_GUARD);
+    memset(bufs->out, VERIFY_CANARY, VERIFY_AREA);
+    memcpy(bufs->out + in_start, bufs->in + in_start, n);
+    caesar_transform_inplace_at(key, key_pos, bufs->out + in_start, n);
+    verify_output(tally, desc, bufs->out, VERIFY_AREA, in_start,
+                  bufs->expected, n);
+}
+
+/**
+ * @brief Check one kernel with every residue of the shift and random keywords
+ * @param state     State of the generator
+ * @param tally     Tally to count the cases in
+ * @param bufs      Buffers to use
+ * @param kernel    Supported kernel to check
+ */
+static void verify_kernel(uint64_t *state, struct verify_tally *tally,
+                          struct verify_bufs *bufs, enum caesar_kernel kernel)
+{
+    struct caesar_key key;
+    struct verify_model model;
+    for (int alphabet = 0; alphabet <= 1; alphabet++) {
+        // Keys repeat every 26 shifts, or every 130 when digits rotate too
+        long n = alphabet ? 130 : 26;
+        for (long r = 0; r < n; r++) {
+            // r, a negative shift, and the largest and smallest longs like it
+            long spellings[] = {
+                r,
+                r - n * 1000,
+                LONG_MAX - verify_reduce(LONG_MAX - r, n),
+                LONG_MIN + verify_reduce(r - LONG_MIN % n, n),
+            };
+            for (size_t i = 0; i < sizeof(spellings) / sizeof(*spellings);
+                 i++) {
+                verify_shift_key(&key, &model, spellings[i], alphabet);
+                if (caesar_key_set_kernel(&key, kernel) < 0) {
+                    continue;
+                }
+                for (int round = 0; round < VERIFY_ROUNDS; round++) {
+                    verify_case(state, tally, bufs, &key, 0, &model, 0);
+                }
+            }
+        }
+    }
+
+    for (int round = 0; round < VERIFY_KEYWORD_ROUNDS; round++) {
+        verify_keyword_key(state, &key, &model);
+        if (caesar_key_set_kernel(&key, kernel) < 0) {
+            break;
+        }
+        uint64_t pos = verify_rand(state);
+        verify_case(state, tally, bufs, &key, pos, &model, pos);
+
+        // A key advanced to an offset crypts from there as if at offset 0
+        caesar_key_advance(&key, pos);
+        verify_case(state, tally, bufs, &key, 0, &model, pos);
+    }
+}
+
+#ifdef HAVE_ZSTD
+/**
+ * @brief Write a buffer to a file as a zstd stream, the way --zstd writes
+ *
+ * The buffer is fed to the compressor in chunks, so the frame has neither a
+ * content size nor a checksum, and decoding it ends with bytes still held by
+ * the decoder.
+ *
+ * @param fd    File to write to
+ * @param data  Bytes to compress
+ * @param len   Number of bytes
+ * @param chunk Number of bytes fed to the compressor at a time
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int verify_zstd_write(int fd, const uint8_t *data, size_t len,
+                             size_t chunk)
+{
+    size_t cap = ZSTD_compressBound(len) + ZSTD_CStreamOutSize();
+    uint8_t *buf = malloc(cap);
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (buf == NULL || cctx == NULL) {
+        free(buf);
+        ZSTD_freeCCtx(cctx);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ret = 0;
+    ZSTD_outBuffer out = {buf, cap, 0};
+    for (size_t off = 0;; off += chunk) {
+        size_t n = len - off < chunk ? len - off : chunk;
+        ZSTD_inBuffer in = {data + off, n, 0};
+        ZSTD_EndDirective mode = off + n == len ? ZSTD_e_end : ZSTD_e_continue;
+        size_t left;
+        do {
+            left = ZSTD_compressStream2(cctx, &out, &in, mode);
+        } while (!ZSTD_isError(left) &&
+                 (mode == ZSTD_e_end ? left != 0 : in.pos < in.size));
+        if (ZSTD_isError(left)) {
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+        if (mode == ZSTD_e_end) {
+            break;
+        }
+    }
+    if (ret == 0) {
+        ret = write_all(fd, (char *)buf, out.pos);
+    }
+
+    int saved_errno = errno;
+    ZSTD_freeCCtx(cctx);
+    free(buf);
+    errno = saved_errno;
+    return ret;
+}
+
+/**
+ * @brief Decode a zstd stream held in a file
+ * @param fd    File to read from its start
+ * @param out   Buffer for the decoded bytes
+ * @param cap   Size of out
+ * @return Number of bytes decoded, or -1 on failure with errno set, EBADMSG
+ *         if the stream is corrupt or cut short
+ */
+static ssize_t verify_zstd_read(int fd, uint8_t *out, size_t cap)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    uint8_t *buf = malloc(st.st_size > 0 ? st.st_size : 1);
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (buf == NULL || dctx == NULL) {
+        free(buf);
+        ZSTD_freeDCtx(dctx);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ssize_t ret = pread(fd, buf, st.st_size, 0);
+    if (ret == st.st_size) {
+        ZSTD_inBuffer in = {buf, st.st_size, 0};
+        ZSTD_outBuffer decoded = {out, cap, 0};
+        size_t zret;
+        for (;;) {
+            // Like the engine, drain the decoder once the input is used up
+            size_t before = decoded.pos;
+            zret = ZSTD_decompressStream(dctx, &decoded, &in);
+            if (ZSTD_isError(zret) || decoded.pos == cap ||
+                (in.pos == in.size && (zret == 0 || decoded.pos == before))) {
+                break;
+            }
+        }
+        if (ZSTD_isError(zret) || zret != 0) {
+            errno = EBADMSG;
+            ret = -1;
+        } else {
+            ret = decoded.pos;
+        }
+    } else if (ret >= 0) {
+        errno = EIO;
+        ret = -1;
+    }
+
+    int saved_errno = errno;
+    ZSTD_freeDCtx(dctx);
+    free(buf);
+    errno = saved_errno;
+    return ret;
+}
+#endif
+
+/**
+ * @brief Write the bytes of a pipe end into it, then close it
+ * @param arg   Pipe end to feed
+ * @return NULL
+ */
+static void *verify_feed(void *arg)
+{
+    struct verify_pipe_end *end = arg;
+    if (write_all(end->fd, (char *)end->data, end->len) < 0) {
+        end->err = errno;
+    }
+    close(end->fd);
+    return NULL;
+}
+
+/**
+ * @brief Read a pipe end until its end of file
+ *
+ * Bytes past the size of the buffer are read and dropped, so that the writer
+ * never blocks, and leave the count at the size of the buffer.
+ *
+ * @param arg   Pipe end to drain
+ * @return NULL
+ */
+static void *verify_drain(void *arg)
+{
+    struct verify_pipe_end *end = arg;
+    uint8_t scrap[4096];
+    for (;;) {
+        bool full = end->len == end->cap;
+        ssize_t n = read(end->fd, full ? scrap : end->data + end->len,
+                         full ? sizeof(scrap) : end->cap - end->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            end->err = errno;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        end->len += full ? 0 : (size_t)n;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Run a stream engine from a pipe into a pipe
+ *
+ * The input pipe is fed and the output pipe drained by a thread each, so the
+ * engine never sees a seekable file, and crypt_stream_splice() hands its
+ * pages to a reader that copies them out, as it requires.
+ *
+ * @param key           Prepared key
+ * @param engine        ve_pipe or ve_splice
+ * @param in            Bytes to feed
+ * @param size          Number of bytes to feed
+ * @param out           Buffer for the output
+ * @param cap           Size of out
+ * @param block_size    Block size of crypt_stream()
+ * @param ret           Set to what the engine returned, errno being kept
+ * @param got           Set to the number of output bytes
+ * @return 0 if the engine ran, or -1 on failure to set it up with errno set
+ */
+static int verify_pipe(const struct caesar_key *key, enum verify_engine engine,
+                       const uint8_t *in, size_t size, uint8_t *out,
+                       size_t cap, size_t block_size, int *ret, ssize_t *got)
+{
+    int in_pipe[2];
+    int out_pipe[2];
+    if (pipe2(in_pipe, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    if (pipe2(out_pipe, O_CLOEXEC) < 0) {
+        int saved_errno = errno;
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        errno = saved_errno;
+        return -1;
+    }
+
+    struct verify_pipe_end feed = {
+        .fd = in_pipe[1], .data = (uint8_t *)in, .len = size};
+    struct verify_pipe_end drain = {.fd = out_pipe[0], .data = out, .cap = cap};
+    pthread_t feeder;
+    pthread_t drainer;
+    int err = pthread_create(&feeder, NULL, verify_feed, &feed);
+    bool feeding = err == 0;
+    if (!feeding) {
+        close(in_pipe[1]);
+    } else {
+        err = pthread_create(&drainer, NULL, verify_drain, &drain);
+    }
+    bool draining = feeding && err == 0;
+
+    int saved_errno = 0;
+    if (draining) {
+        *ret = engine == ve_splice
+                   ? crypt_stream_splice(key, in_pipe[0], out_pipe[1])
+                   : crypt_stream(key, in_pipe[0], out_pipe[1], block_size);
+        saved_errno = errno;
+    }
+    close(out_pipe[1]);
+
+    // Consume whatever the engine left, so that the feeder can finish
+    uint8_t scrap[4096];
+    ssize_t n;
+    while ((n = read(in_pipe[0], scrap, sizeof(scrap))) > 0 ||
+           (n < 0 && errno == EINTR)) {
+    }
+    close(in_pipe[0]);
+    if (feeding) {
+        pthread_join(feeder, NULL);
+    }
+    if (draining) {
+        pthread_join(drainer, NULL);
+    }
+    close(out_pipe[0]);
+
+    if (!draining || feed.err != 0 || drain.err != 0) {
+        errno = !draining ? err : feed.err != 0 ? feed.err : drain.err;
+        return -1;
+    }
+    *got = drain.len;
+    errno = saved_errno;
+    return 0;
+}
+
+/**
+ * @brief Check a stream engine on a random file
+ * @param state     State of the generator
+ * @param tally     Tally to count the case in
+ * @param engine    Engine to check
+ * @param in_fd     Empty in-memory file for the input
+ * @param out_fd    Empty in-memory file for the output
+ * @param in        Buffer of VERIFY_STREAM_MAX bytes for the input
+ * @param out       Buffer of VERIFY_STREAM_MAX + 1 bytes for the output
+ * @param expected  Buffer of VERIFY_STREAM_MAX bytes for the expected output
+ * @return 0 on success, or -1 on failure with errno set
+ */
+static int verify_engine(uint64_t *state, struct verify_tally *tally,
+                         enum verify_engine engine, int in_fd, int out_fd,
+                         uint8_t *in, uint8_t *out, uint8_t *expected)
+{
+    // Tiny blocks only on small files, to keep the number of calls down
+    uint64_t r = verify_rand(state);
+    size_t size = (r >> 8) % (VERIFY_STREAM_MAX + 1);
+    size_t block_size = 1 + (r >> 32) % (64 * 1024);
+    if (r % 4 == 0) {
+        size %= 4096;
+        block_size %= 64;
+        block_size++;
+    }
+    size_t nthreads = 1 + (r >> 4) % 4;
+    if (engine == ve_zstd) {
+        // Always more than a block, the frame ending inside the last one
+        size = block_size + size % (VERIFY_STREAM_MAX - block_size + 1);
+    }
+
+    struct caesar_key key;
+    struct verify_model model;
+    if (verify_rand(state) % 2) {
+        verify_shift_key(&key, &model, (long)verify_rand(state), false);
+    } else {
+        verify_keyword_key(state, &key, &model);
+    }
+
+    verify_fill(state, in, size);
+    if (write_all(in_fd, (char *)in, size) < 0 ||
+        lseek(in_fd, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    uint64_t offset = 0;
+    size_t length = size;
+    ssize_t got = -1;
+    int ret = -1;
+    switch (engine) {
+    case ve_stream:
+        ret = crypt_stream(&key, in_fd, out_fd, block_size);
+        break;
+    case ve_pipe:
+    case ve_splice:
+        if (verify_pipe(&key, engine, in, size, out, VERIFY_STREAM_MAX + 1,
+                        block_size, &ret, &got) < 0) {
+            return -1;
+        }
+        break;
+    case ve_parallel:
+        ret = crypt_stream_parallel(&key, in_fd, out_fd, block_size,
+                                    nthreads);
+        break;
+    case ve_lines:
+        ret = crypt_stream_lines(&key, in_fd, out_fd, block_size, 0);
+        break;
+    case ve_range:
+        // Sometimes running past the end of the file
+        offset = verify_rand(state) % (size + 1);
+        length = verify_rand(state) % (size - offset + 2);
+        ret = crypt_file_range(&key, in_fd, out_fd, offset,
+                               length > size - offset ? UINT64_MAX : length,
+                               block_size);
+        length = length > size - offset ? size - offset : length;
+        break;
+    case ve_zstd:
+        // The input is replaced by its compressed form
+#ifdef HAVE_ZSTD
+        if (ftruncate(in_fd, 0) < 0 ||
+            verify_zstd_write(in_fd, in, size, block_size) < 0 ||
+            lseek(in_fd, 0, SEEK_SET) < 0) {
+            return -1;
+        }
+#endif
+        ret = crypt_stream_compressed(&key, sf_zstd, in_fd, out_fd,
+                                      block_size);
+        break;
+    default:
+        ret = crypt_file_in_place(&key, in_fd, nthreads);
+        out_fd = in_fd;
+        break;
+    }
+
+    char desc[160];
+    snprintf(desc, sizeof(desc), "%s, %zu of %zu bytes from %llu, block size "
+                                 "%zu, %zu threads",
+             model.desc, length, size, (unsigned long long)offset, block_size,
+             nthreads);
+    if (ret < 0) {
+        tally->cases++;
+        if (tally->failures++ == 0) {
+            fprintf(stderr, "verify: %s: %s: %s\n", tally->name, desc,
+                    strerror(errno));
+        }
+        return 0;
+    }
+
+    if (engine == ve_zstd) {
+#ifdef HAVE_ZSTD
+        got = verify_zstd_read(out_fd, out, VERIFY_STREAM_MAX + 1);
+        if (got < 0 && errno == EBADMSG) {
+            tally->cases++;
+            if (tally->failures++ == 0) {
+                fprintf(stderr, "verify: %s: %s: invalid output\n",
+                        tally->name, desc);
+            }
+            return 0;
+        }
+#endif
+    } else if (engine != ve_pipe && engine != ve_splice) {
+        // The pipe engines' output has already been drained into out
+        got = pread(out_fd, out, VERIFY_STREAM_MAX + 1, 0);
+    }
+    if (got < 0) {
+        return -1;
+    }
+    if ((size_t)got != length) {
+        tally->cases++;
+        if (tally->failures++ == 0) {
+            fprintf(stderr, "verify: %s: %s: wrote %zd bytes\n", tally->name,
+                    desc, got);
+        }
+        return 0;
+    }
+    verify_model_crypt(&model, offset, in + offset, expected, length);
+    verify_output(tally, desc, out, length, 0, expected, length);
+    return 0;
+}
+
+/**
+ * @brief Print the tally of a kernel or engine as a line of JSON
+ * @param kind  Kind of what was checked
+ * @param tally Tally to print
+ */
+static void verify_report(const char *kind, const struct verify_tally *tally)
+{
+    printf("{\"%s\":\"%s\",\"cases\":%llu,\"failures\":%llu}\n", kind,
+           tally->name, tally->cases, tally->failures);
+    fflush(stdout);
+}
+
+int verify(uint64_t seed)
+{
+    // xorshift64* must never be seeded with 0
+    uint64_t state = seed ^ 0x9e3779b97f4a7c15ULL;
+    state = state != 0 ? state : 1;
+    printf("{\"seed\":%llu}\n", (unsigned long long)seed);
+
+    int ret = -1;
+    bool failed = false;
+    int in_fd = -1;
+    int out_fd = -1;
+    struct verify_bufs *bufs = malloc(sizeof(*bufs));
+    uint8_t *in = malloc(VERIFY_STREAM_MAX);
+    uint8_t *out = malloc(VERIFY_STREAM_MAX + 1);
+    uint8_t *expected = malloc(VERIFY_STREAM_MAX);
+    if (bufs == NULL || in == NULL || out == NULL || expected == NULL) {
+        goto out;
+    }
+
+    for (int kernel = 0; kernel < CAESAR_KERNEL_COUNT; kernel++) {
+        if (!caesar_kernel_supported(kernel)) {
+            continue;
+        }
+        struct verify_tally tally = {.name = caesar_kernel_name(kernel)};
+        verify_kernel(&state, &tally, bufs, kernel);
+        verify_report("kernel", &tally);
+        failed |= tally.failures > 0;
+    }
+
+    in_fd = memfd_create("caesar-verify-in", 0);
+    out_fd = memfd_create("caesar-verify-out", 0);
+    if (in_fd < 0 || out_fd < 0) {
+        goto out;
+    }
+    bool uring = stream_uring_supported();
+    for (int engine = 0; engine < ve_count; engine++) {
+        if (engine == ve_zstd && !stream_format_supported(sf_zstd)) {
+            continue;
+        }
+        struct verify_tally tally = {
+            .name = uring && URING_ENGINE_NAMES[engine] != NULL
+                        ? URING_ENGINE_NAMES[engine]
+                        : ENGINE_NAMES[engine]};
+        for (int round = 0; round < VERIFY_STREAM_ROUNDS; round++) {
+            if (ftruncate(in_fd, 0) < 0 || ftruncate(out_fd, 0) < 0 ||
+                lseek(in_fd, 0, SEEK_SET) < 0 ||
+                lseek(out_fd, 0, SEEK_SET) < 0 ||
+                verify_engine(&state, &tally, engine, in_fd, out_fd, in, out,
+                              expected) < 0) {
+                goto out;
+            }
+        }
+        verify_report("engine", &tally);
+        failed |= tally.failures > 0;
+    }
+    ret = failed ? 1 : 0;
+
+out:;
+    int saved_errno = errno;
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+    free(bufs);
+    free(in);
+    free(out);
+    free(expected);
+    errno = saved_errno;
+    return ret;
+}
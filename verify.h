@@ -0,0 +1,32 @@
+/**
+ * @file verify.h
+ * Differential check of every kernel and stream engine against a model.
+ */
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdint.h>
+
+/**
+ * @brief Check every kernel and stream engine on random inputs
+ *
+ * Each supported kernel crypts random buffers at random alignments and with
+ * lengths that are not a multiple of any vector width, in and out of place,
+ * for every residue of the shift modulo 26 spelled as small, negative and
+ * extreme longs, and for random keywords at random stream offsets. Results
+ * are compared byte by byte with an independent scalar model, and the bytes
+ * around the output are checked to be untouched. Each stream engine then
+ * crypts random in-memory files with random block sizes and thread counts,
+ * and crypt_stream() and crypt_stream_splice() also crypt from a pipe into a
+ * pipe.
+ *
+ * One line of JSON is printed per kernel or engine with the number of cases
+ * and failures, and the first failure of each is described on stderr.
+ *
+ * @param seed  Seed of the random inputs, printed so a run can be repeated
+ * @return 0 if every case matched, 1 if any did not, or -1 on failure with
+ *         errno set
+ */
+int verify(uint64_t seed);
+
+#endif